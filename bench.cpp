@@ -0,0 +1,474 @@
+#include "library.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <random>
+#include <thread>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <stdexcept>
+
+//Every measurement is repeated with more iterations until it takes at least this long
+constexpr double MinimumSeconds = 0.2;
+constexpr uint32_t RayCount = 1024;
+
+struct Result
+{
+	std::string name;
+	uint64_t iterations;
+	double seconds;
+	size_t bytes = 0; //The memory of the measured data structure, if relevant
+};
+
+std::vector<Result> results;
+
+/**
+ * Prevents the compiler from optimizing away the computation of a value.
+ */
+template<class T>
+void keep(const T& value) { asm volatile("" : : "r,m"(value) : "memory"); }
+
+/**
+ * Measures the average time of an action, which receives the index of the current iteration.
+ */
+template<class Action>
+void measure(const std::string& name, Action action)
+{
+	using Clock = std::chrono::steady_clock;
+	uint64_t iterations = 1;
+
+	while (true)
+	{
+		auto start = Clock::now();
+		for (uint64_t i = 0; i < iterations; ++i) action(i);
+		double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+		if (seconds >= MinimumSeconds)
+		{
+			results.push_back({ name, iterations, seconds });
+			std::cout << std::left << std::setw(40) << name << std::right << std::setw(14) << std::fixed << std::setprecision(2)
+			          << seconds / static_cast<double>(iterations) * 1E9 << " ns" << std::endl;
+			return;
+		}
+
+		iterations *= seconds < MinimumSeconds / 16.0 ? 16 : 2;
+	}
+}
+
+/**
+ * Creates rays starting inside of the volume filled by insert_procedural by default, pointing in random directions.
+ */
+std::vector<Ray> make_rays(std::mt19937& random)
+{
+	std::uniform_real_distribution<float> distribution(-5.0f, 5.0f);
+	std::vector<Ray> rays;
+
+	while (rays.size() < RayCount)
+	{
+		Vec3 origin(distribution(random), distribution(random) + 5.0f, distribution(random));
+		Vec3 direction = normalize(Vec3(distribution(random), distribution(random), distribution(random)));
+		if (magnitude_squared(direction) > 0.0f) rays.emplace_back(origin, direction);
+	}
+
+	return rays;
+}
+
+/**
+ * Creates a scene with a floor plane and a number of generated primitives, see insert_procedural.
+ */
+Scene make_scene(ProceduralKind kind, uint32_t count)
+{
+	ProceduralSettings settings;
+	settings.kind = kind;
+	settings.count = count;
+
+	Scene scene;
+	scene.insert_plane({ 0.0f, 1.0f, 0.0f }, 0.0f);
+	insert_procedural(scene, settings);
+	return scene;
+}
+
+/**
+ * Measures Scene::intersect over a set of rays, recording the memory the measured structure takes, if any.
+ */
+void measure_intersect(const std::string& name, const Scene& scene, const std::vector<Ray>& rays, size_t bytes = 0)
+{
+	measure(name, [&](uint64_t i)
+	{
+		float distance;
+		Vec3 normal;
+		uint32_t material;
+		keep(scene.intersect(rays[i % rays.size()], distance, normal, material));
+		keep(distance);
+	});
+
+	results.back().bytes = bytes;
+}
+
+void measure_intersections(std::mt19937& random)
+{
+	std::vector<Ray> rays = make_rays(random);
+	auto ray = [&](uint64_t i) -> const Ray& { return rays[i % RayCount]; };
+
+	measure("intersect_sphere", [&](uint64_t i)
+	{
+		Vec3 normal;
+		keep(intersect_sphere(ray(i), Vec3(1.0f, 0.5f, 2.0f), 2.0f, normal));
+		keep(normal);
+	});
+
+	measure("intersect_plane", [&](uint64_t i)
+	{
+		keep(intersect_plane(ray(i), Vec3(0.0f, 1.0f, 0.0f), 1.0f));
+	});
+
+	measure("intersect_box", [&](uint64_t i)
+	{
+		Vec3 normal;
+		keep(intersect_box(ray(i), Vec3(-1.0f, -2.0f, 0.5f), Vec3(1.5f, 2.0f, 3.0f), normal));
+		keep(normal);
+	});
+
+	for (auto [kind, name] : { std::pair(ProceduralKind::Spheres, "spheres"), std::pair(ProceduralKind::Boxes, "boxes") })
+	{
+		for (uint32_t count : { 10, 100, 1000 })
+		{
+			Scene scene = make_scene(kind, count);
+
+			measure_intersect(std::string("Scene::intersect/") + name + "/" + std::to_string(count), scene, rays);
+		}
+	}
+}
+
+/**
+ * Measures the traversal of every BVH layout over large scenes, with the memory of their nodes and references.
+ */
+void measure_bvh(std::mt19937& random)
+{
+	std::vector<Ray> rays = make_rays(random);
+
+	const std::pair<BVHLayout, const char*> layouts[] = { { BVHLayout::Binary, "binary" }, { BVHLayout::Compressed, "compressed" } };
+
+	for (uint32_t count : { 1000, 100000 })
+	{
+		Scene scene = make_scene(ProceduralKind::Spheres, count);
+
+		for (auto [layout, layout_name] : layouts)
+		{
+			scene.build_bvh({ layout });
+			std::string name = std::string("Scene::intersect/") + layout_name + "/spheres/" + std::to_string(count);
+
+			const BVH& bvh = scene.get_bvh();
+			measure_intersect(name, scene, rays, bvh.get_bytes());
+			std::cout << "  " << bvh.get_node_count() << " nodes, " << bvh.get_bytes() << " bytes, SAH cost " << bvh.get_sah_cost() << std::endl;
+		}
+	}
+}
+
+/**
+ * Compares the object split builder against spatial splits on scenes of large overlapping boxes and thin stacked slabs.
+ */
+void measure_spatial_splits(std::mt19937& random)
+{
+	std::vector<Ray> rays = make_rays(random);
+
+	//Long thin boxes along random axes, which overlap the bounds of many others
+	Scene sticks;
+	std::uniform_real_distribution<float> position(-5.0f, 5.0f);
+
+	for (uint32_t i = 0; i < 10000; ++i)
+	{
+		Vec3 size(0.05f);
+		(i % 3 == 0 ? size.x : i % 3 == 1 ? size.y : size.z) = 4.0f;
+		sticks.insert_box(Vec3(position(random), position(random) + 5.0f, position(random)), size);
+	}
+
+	std::pair<std::string, Scene> scenes[] = { { "boxes", make_scene(ProceduralKind::Boxes, 10000) },
+	                                           { "stack", make_scene(ProceduralKind::Stack, 10000) },
+	                                           { "sticks", std::move(sticks) } };
+
+	for (auto& [kind_name, scene] : scenes)
+	{
+		for (float budget : { 0.0f, 0.5f })
+		{
+			scene.build_bvh({ BVHLayout::Binary, budget });
+			std::string name = std::string("Scene::intersect/") + (budget > 0.0f ? "spatial" : "object") + "/" + kind_name + "/10000";
+
+			const BVH& bvh = scene.get_bvh();
+			measure_intersect(name, scene, rays, bvh.get_bytes());
+			std::cout << "  " << bvh.get_reference_count() << " references, SAH cost " << bvh.get_sah_cost() << std::endl;
+		}
+	}
+}
+
+/**
+ * Compares the depth first node order against treelets on a scene whose nodes are much larger than the caches.
+ */
+void measure_treelets(std::mt19937& random)
+{
+	std::vector<Ray> rays = make_rays(random);
+	Scene scene = make_scene(ProceduralKind::Spheres, 1000000);
+
+	for (bool treelets : { false, true })
+	{
+		BVHSettings settings;
+		settings.treelets = treelets;
+		scene.build_bvh(settings);
+
+		measure_intersect(std::string("Scene::intersect/") + (treelets ? "treelets" : "depth_first") + "/spheres/1000000", scene, rays, scene.get_bvh().get_bytes());
+	}
+}
+
+/**
+ * Compares regular pages against transparent huge pages for the scene and BVH of a scene much larger than the TLB reach.
+ */
+void measure_huge_pages(std::mt19937& random)
+{
+	std::vector<Ray> rays = make_rays(random);
+	HugePages previous = get_huge_pages();
+
+	for (auto [mode, mode_name] : { std::pair(HugePages::Off, "off"), std::pair(HugePages::Transparent, "transparent") })
+	{
+		//The mode only applies to new allocations, so the whole scene is created again
+		set_huge_pages(mode);
+		Scene scene = make_scene(ProceduralKind::Spheres, 1000000);
+		scene.build_bvh();
+
+		measure_intersect(std::string("Scene::intersect/huge_pages_") + mode_name + "/spheres/1000000", scene, rays, scene.get_bvh().get_bytes());
+		std::cout << "  " << get_huge_page_bytes() / (1 << 20) << " MB on huge pages" << std::endl;
+	}
+
+	set_huge_pages(previous);
+}
+
+/**
+ * Compares building the whole BVH up front against a lazy one, for rays that only reach a corner of a large scene.
+ * Every iteration builds the hierarchy again and traces the rays, as the first frame of a render would.
+ */
+void measure_lazy_bvh(std::mt19937& random)
+{
+	std::uniform_real_distribution<float> distribution(-1.0f, 1.0f);
+	std::vector<Ray> rays;
+
+	while (rays.size() < RayCount)
+	{
+		Vec3 direction = normalize(Vec3(distribution(random) * 0.1f - 1.0f, distribution(random) * 0.1f, distribution(random) * 0.1f - 1.0f));
+		rays.emplace_back(Vec3(-3.0f, 2.0f, -3.0f), direction);
+	}
+
+	Scene scene = make_scene(ProceduralKind::Spheres, 1000000);
+
+	for (uint32_t lazy_size : { 0u, 4096u })
+	{
+		BVHSettings settings;
+		settings.lazy_size = lazy_size;
+
+		measure(std::string("Scene::build_bvh/") + (lazy_size == 0 ? "eager" : "lazy") + "/spheres/1000000", [&](uint64_t)
+		{
+			scene.build_bvh(settings);
+
+			for (const Ray& ray : rays)
+			{
+				float distance;
+				Vec3 normal;
+				uint32_t material;
+				keep(scene.intersect(ray, distance, normal, material));
+			}
+		});
+
+		const BVH& bvh = scene.get_bvh();
+		results.back().bytes = bvh.get_bytes();
+		if (lazy_size != 0) std::cout << "  built " << bvh.get_built_subtree_count() << " of " << bvh.get_subtree_count() << " subtrees" << std::endl;
+	}
+}
+
+/**
+ * Compares particles against spheres of the same count, in the memory of the whole scene and the time of intersecting it.
+ */
+void measure_particles(std::mt19937& random)
+{
+	std::vector<Ray> rays = make_rays(random);
+
+	for (uint32_t count : { ParticleLeafSize, 1000000U })
+	{
+		for (auto [kind, name] : { std::pair(ProceduralKind::Spheres, "spheres"), std::pair(ProceduralKind::Particles, "particles") })
+		{
+			//A single leaf is tested without a BVH, against as many spheres
+			Scene scene = make_scene(kind, count);
+			if (count > ParticleLeafSize) scene.build_bvh();
+
+			//A single leaf only measures the intersection, its memory is not comparable
+			measure_intersect(std::string("Scene::intersect/") + name + "/" + std::to_string(count), scene, rays, count == ParticleLeafSize ? 0 : scene.get_bytes());
+
+			if (count == ParticleLeafSize) continue;
+			std::cout << "  " << static_cast<double>(scene.get_bytes()) / count << " bytes per primitive" << std::endl;
+		}
+	}
+}
+
+void measure_sampling()
+{
+	Vec3 normal = normalize(Vec3(0.3f, 1.0f, -0.2f));
+	Vec3 outgoing = normalize(Vec3(-0.5f, 0.8f, 0.1f));
+
+	measure("random_float", [&](uint64_t) { keep(random_float()); });
+	measure("random_cosine_hemisphere", [&](uint64_t) { keep(random_cosine_hemisphere(normal)); });
+
+	measure("bsdf_lambertian_reflection", [&](uint64_t)
+	{
+		Vec3 incident;
+		keep(bsdf_lambertian_reflection(outgoing, normal, incident));
+		keep(incident);
+	});
+
+	measure("bsdf_specular_reflection", [&](uint64_t)
+	{
+		Vec3 incident;
+		keep(bsdf_specular_reflection(outgoing, normal, incident));
+		keep(incident);
+	});
+
+	measure("bsdf_specular_fresnel", [&](uint64_t)
+	{
+		Vec3 incident;
+		keep(bsdf_specular_fresnel(outgoing, normal, incident, 1.0f / 1.5f));
+		keep(incident);
+	});
+}
+
+void measure_encoding(std::mt19937& random)
+{
+	std::vector<Ray> rays = make_rays(random);
+	std::vector<uint32_t> encoded;
+	for (const Ray& ray : rays) encoded.push_back(encode_octahedral(ray.direction));
+
+	measure("encode_octahedral", [&](uint64_t i) { keep(encode_octahedral(rays[i % RayCount].direction)); });
+	measure("decode_octahedral", [&](uint64_t i) { keep(decode_octahedral(encoded[i % RayCount])); });
+	measure("encode_half", [&](uint64_t i) { keep(encode_half(static_cast<float>(i))); });
+	measure("decode_half", [&](uint64_t i) { keep(decode_half(static_cast<uint16_t>(i))); });
+}
+
+void measure_parallel_for()
+{
+	//The fixed cost of starting and joining the workers
+	measure("parallel_for/call", [&](uint64_t)
+	{
+		parallel_for(0, 1, [](uint32_t index) { keep(index); });
+	});
+
+	//The cost of distributing every single index
+	constexpr uint32_t Count = 1 << 16;
+
+	measure("parallel_for/index", [&](uint64_t i)
+	{
+		if (i % Count != 0) return;
+		parallel_for(0, Count, [](uint32_t index) { keep(index); });
+	});
+}
+
+/**
+ * Compares filling short lived per tile containers from the heap against the arena of the thread.
+ */
+void measure_arena()
+{
+	constexpr uint32_t Count = 256;
+
+	measure("std::vector/tile", [&](uint64_t)
+	{
+		std::vector<PrimitiveID> primitives;
+		for (uint32_t i = 0; i < Count; ++i) primitives.push_back(i);
+		keep(primitives.data());
+	});
+
+	measure("ArenaVector/tile", [&](uint64_t)
+	{
+		ArenaScope scope(get_thread_arena());
+		ArenaVector<PrimitiveID> primitives;
+		for (uint32_t i = 0; i < Count; ++i) primitives.push_back(i);
+		keep(primitives.data());
+	});
+}
+
+void measure_write_image()
+{
+	constexpr uint32_t Size = 256;
+	std::vector<Color> colors(Size * Size);
+	for (uint32_t i = 0; i < Size * Size; ++i) colors[i] = Color(random_float(), random_float(), random_float());
+
+	measure("write_image/256x256", [&](uint64_t)
+	{
+		write_image("bench_image.png", Size, Size, colors.data());
+	});
+
+	std::remove("bench_image.png");
+}
+
+/**
+ * Returns a string with the quotes, backslashes and control characters escaped so it can be written inside a JSON string.
+ */
+std::string escape_json(const std::string& value)
+{
+	std::string result;
+
+	for (char character : value)
+	{
+		if (character == '"' || character == '\\') result += '\\';
+
+		if (static_cast<unsigned char>(character) < 0x20)
+		{
+			char escaped[8];
+			std::snprintf(escaped, sizeof(escaped), "\\u%04x", character);
+			result += escaped;
+		}
+		else result += character;
+	}
+
+	return result;
+}
+
+void write_results(const std::string& filename)
+{
+	std::ofstream stream(filename);
+	stream << "{\n";
+	stream << "  \"threads\": " << std::thread::hardware_concurrency() << ",\n";
+	stream << "  \"compiler\": \"" << __VERSION__ << "\",\n";
+	stream << "  \"benchmarks\": [\n";
+
+	for (size_t i = 0; i < results.size(); ++i)
+	{
+		const Result& result = results[i];
+		double nanoseconds = result.seconds / static_cast<double>(result.iterations) * 1E9;
+
+		stream << "    { \"name\": \"" << escape_json(result.name) << "\", \"iterations\": " << result.iterations
+		       << ", \"seconds\": " << result.seconds << ", \"ns_per_op\": " << nanoseconds;
+		if (result.bytes != 0) stream << ", \"bytes\": " << result.bytes;
+		stream << " }";
+		stream << (i + 1 < results.size() ? ",\n" : "\n");
+	}
+
+	stream << "  ]\n}\n";
+	if (not stream) throw std::runtime_error("Error in when outputting benchmark results.");
+}
+
+int main(int argc, char** argv)
+{
+	std::string output = argc > 1 ? argv[1] : "bench.json";
+	std::mt19937 random(42);
+
+	measure_intersections(random);
+	measure_bvh(random);
+	measure_spatial_splits(random);
+	measure_treelets(random);
+	measure_huge_pages(random);
+	measure_lazy_bvh(random);
+	measure_particles(random);
+	measure_sampling();
+	measure_encoding(random);
+	measure_parallel_for();
+	measure_arena();
+	measure_write_image();
+
+	write_results(output);
+	return 0;
+}
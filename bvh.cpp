@@ -0,0 +1,716 @@
+#include "library.hpp"
+
+#include <cmath>
+#include <queue>
+#include <stdexcept>
+#include <algorithm>
+
+constexpr uint32_t BinCount = 16;
+constexpr uint32_t MaxLeafSize = 4;
+constexpr uint32_t MaxDepth = 64;     //Deeper nodes are split at the median, which bounds the traversal stacks
+constexpr float TraversalCost = 1.0f; //The cost of visiting a node relative to testing a primitive
+
+using BVHNodes = LargeVector<BVHNode>;
+
+//Spatial splits are only tried where the children of the object split overlap by more than this fraction of the root area
+constexpr float SpatialOverlap = 1E-5f;
+
+struct BuildReference
+{
+	Vec3 min;
+	Vec3 max;
+	PrimitiveID primitive;
+};
+
+static Vec3 component_min(Vec3 value, Vec3 other) { return { std::min(value.x, other.x), std::min(value.y, other.y), std::min(value.z, other.z) }; }
+static Vec3 component_max(Vec3 value, Vec3 other) { return { std::max(value.x, other.x), std::max(value.y, other.y), std::max(value.z, other.z) }; }
+static float get_axis(Vec3 value, uint32_t axis) { return axis == 0 ? value.x : axis == 1 ? value.y : value.z; }
+static float& get_axis_reference(Vec3& value, uint32_t axis) { return axis == 0 ? value.x : axis == 1 ? value.y : value.z; }
+static Vec3 get_center(const BuildReference& reference) { return (reference.min + reference.max) * 0.5f; }
+
+struct Bounds
+{
+	Vec3 min = Vec3(Infinity);
+	Vec3 max = Vec3(-Infinity);
+
+	void extend(Vec3 other_min, Vec3 other_max)
+	{
+		min = component_min(min, other_min);
+		max = component_max(max, other_max);
+	}
+
+	void extend(const Bounds& other) { extend(other.min, other.max); }
+
+	float get_area() const
+	{
+		Vec3 size = max - min;
+		if (size.x < 0.0f || size.y < 0.0f || size.z < 0.0f) return 0.0f;
+		return 2.0f * (size.x * size.y + size.y * size.z + size.z * size.x);
+	}
+};
+
+/**
+ * The state shared by the whole build.
+ */
+struct BuildContext
+{
+	BVHNodes& nodes;
+	LargeVector<PrimitiveID>& references;
+	float root_area = 0.0f;
+	size_t duplicates_left = 0; //The references spatial splits may still add
+};
+
+/**
+ * A candidate split of a node, either between the bins of the reference centers (object split)
+ * or at a plane that cuts the references straddling it in two (spatial split).
+ */
+struct Split
+{
+	float cost = Infinity;
+	uint32_t axis = 0;
+	uint32_t bin = 0;
+	bool spatial = false;
+	Bounds left;
+	Bounds right;
+};
+
+static uint32_t get_bin(float position, float low, float scale)
+{
+	float bin = std::max((position - low) * scale, 0.0f);
+	return std::min(static_cast<uint32_t>(bin), BinCount - 1);
+}
+
+/**
+ * Sweeps the bins of a split candidate, keeping the split between two bins with the lowest cost.
+ * @param left_counts The number of references on the left of bin i counts from the bins before it, given by entering.
+ * @param right_counts The number of references on the right of bin i counts from the bins from it on, given by leaving.
+ */
+static void sweep_bins(const Bounds (&bins)[BinCount], const uint32_t (&entering)[BinCount], const uint32_t (&leaving)[BinCount],
+                       uint32_t axis, bool spatial, Split& best)
+{
+	Bounds rights[BinCount];
+	uint32_t right_counts[BinCount];
+	Bounds right;
+	uint32_t right_count = 0;
+
+	for (uint32_t bin = BinCount - 1; bin > 0; --bin)
+	{
+		right.extend(bins[bin]);
+		right_count += leaving[bin];
+		rights[bin] = right;
+		right_counts[bin] = right_count;
+	}
+
+	Bounds left;
+	uint32_t left_count = 0;
+
+	for (uint32_t bin = 1; bin < BinCount; ++bin)
+	{
+		left.extend(bins[bin - 1]);
+		left_count += entering[bin - 1];
+		if (left_count == 0 || right_counts[bin] == 0) continue;
+
+		float cost = left.get_area() * static_cast<float>(left_count) + rights[bin].get_area() * static_cast<float>(right_counts[bin]);
+		if (cost >= best.cost) continue;
+
+		best.cost = cost;
+		best.axis = axis;
+		best.bin = bin;
+		best.spatial = spatial;
+		best.left = left;
+		best.right = rights[bin];
+	}
+}
+
+/**
+ * Finds the object split between the bins of the reference centers with the lowest surface area heuristic cost.
+ */
+static Split find_object_split(const std::vector<BuildReference>& references, const Bounds& centers)
+{
+	Split best;
+
+	for (uint32_t axis = 0; axis < 3; ++axis)
+	{
+		float low = get_axis(centers.min, axis);
+		float high = get_axis(centers.max, axis);
+		if (not (high > low)) continue;
+
+		float scale = static_cast<float>(BinCount) / (high - low);
+		Bounds bins[BinCount];
+		uint32_t counts[BinCount] = {};
+
+		for (const BuildReference& reference : references)
+		{
+			uint32_t bin = get_bin(get_axis(get_center(reference), axis), low, scale);
+			bins[bin].extend(reference.min, reference.max);
+			++counts[bin];
+		}
+
+		sweep_bins(bins, counts, counts, axis, false, best);
+	}
+
+	return best;
+}
+
+/**
+ * Returns the part of a reference between two planes along an axis, the bounds of its box clipped to them.
+ */
+static BuildReference clip(BuildReference reference, uint32_t axis, float low, float high)
+{
+	get_axis_reference(reference.min, axis) = std::max(get_axis(reference.min, axis), low);
+	get_axis_reference(reference.max, axis) = std::min(get_axis(reference.max, axis), high);
+	return reference;
+}
+
+/**
+ * Finds the spatial split between equally sized bins of the node bounds with the lowest surface area heuristic cost.
+ * Every reference is clipped to every bin it overlaps, entering the first one and leaving the last one.
+ */
+static Split find_spatial_split(const std::vector<BuildReference>& references, const Bounds& bounds)
+{
+	Split best;
+
+	for (uint32_t axis = 0; axis < 3; ++axis)
+	{
+		float low = get_axis(bounds.min, axis);
+		float high = get_axis(bounds.max, axis);
+		if (not (high > low)) continue;
+
+		float width = (high - low) / static_cast<float>(BinCount);
+		float scale = 1.0f / width;
+		Bounds bins[BinCount];
+		uint32_t entering[BinCount] = {};
+		uint32_t leaving[BinCount] = {};
+
+		for (const BuildReference& reference : references)
+		{
+			uint32_t first = get_bin(get_axis(reference.min, axis), low, scale);
+			uint32_t last = get_bin(get_axis(reference.max, axis), low, scale);
+
+			for (uint32_t bin = first; bin <= last; ++bin)
+			{
+				float plane = low + width * static_cast<float>(bin);
+				BuildReference part = clip(reference, axis, bin == 0 ? low : plane, bin + 1 == BinCount ? high : plane + width);
+				bins[bin].extend(part.min, part.max);
+			}
+
+			++entering[first];
+			++leaving[last];
+		}
+
+		sweep_bins(bins, entering, leaving, axis, true, best);
+	}
+
+	return best;
+}
+
+static void make_leaf(BuildContext& context, uint32_t index, const std::vector<BuildReference>& references)
+{
+	BVHNode& node = context.nodes[index];
+	node.index = static_cast<uint32_t>(context.references.size());
+	node.count = static_cast<uint32_t>(references.size());
+	for (const BuildReference& reference : references) context.references.push_back(reference.primitive);
+}
+
+/**
+ * Builds the node at an index over references, then recursively its children.
+ * Splits with the lowest surface area heuristic cost, and stops at a leaf when that is cheaper and small enough.
+ * Spatial splits are only considered while the duplication budget lasts and where the object split children overlap.
+ */
+static void build_node(BuildContext& context, uint32_t index, std::vector<BuildReference> references, uint32_t depth)
+{
+	Bounds bounds;
+	Bounds centers;
+
+	for (const BuildReference& reference : references)
+	{
+		Vec3 center = get_center(reference);
+		bounds.extend(reference.min, reference.max);
+		centers.extend(center, center);
+	}
+
+	context.nodes[index].min = bounds.min;
+	context.nodes[index].max = bounds.max;
+	uint32_t count = static_cast<uint32_t>(references.size());
+	if (count == 1) return make_leaf(context, index, references);
+
+	Split split = find_object_split(references, centers);
+
+	if (context.duplicates_left > 0 && depth < MaxDepth && split.cost < Infinity)
+	{
+		Bounds overlap;
+		overlap.min = component_max(split.left.min, split.right.min);
+		overlap.max = component_min(split.left.max, split.right.max);
+
+		if (overlap.get_area() > SpatialOverlap * context.root_area)
+		{
+			Split spatial = find_spatial_split(references, bounds);
+			if (spatial.cost < split.cost) split = spatial;
+		}
+	}
+
+	float area = bounds.get_area();
+	float split_cost = area > 0.0f ? TraversalCost + split.cost / area : TraversalCost;
+	if (count <= MaxLeafSize && not (split_cost < static_cast<float>(count))) return make_leaf(context, index, references);
+
+	std::vector<BuildReference> left;
+	std::vector<BuildReference> right;
+
+	if (split.spatial)
+	{
+		float low = get_axis(bounds.min, split.axis);
+		float plane = low + (get_axis(bounds.max, split.axis) - low) / static_cast<float>(BinCount) * static_cast<float>(split.bin);
+
+		for (const BuildReference& reference : references)
+		{
+			if (get_axis(reference.max, split.axis) <= plane) left.push_back(reference);
+			else if (get_axis(reference.min, split.axis) >= plane) right.push_back(reference);
+			else
+			{
+				//Straddles the plane, so both sides receive their part of it
+				left.push_back(clip(reference, split.axis, -Infinity, plane));
+				right.push_back(clip(reference, split.axis, plane, Infinity));
+			}
+		}
+
+		size_t duplicates = left.size() + right.size() - references.size();
+		context.duplicates_left -= std::min(duplicates, context.duplicates_left);
+	}
+	else if (split.cost < Infinity && depth < MaxDepth)
+	{
+		float low = get_axis(centers.min, split.axis);
+		float scale = static_cast<float>(BinCount) / (get_axis(centers.max, split.axis) - low);
+
+		for (const BuildReference& reference : references)
+		{
+			bool is_left = get_bin(get_axis(get_center(reference), split.axis), low, scale) < split.bin;
+			(is_left ? left : right).push_back(reference);
+		}
+	}
+
+	if (left.empty() || right.empty())
+	{
+		//Falls back to the median along the largest axis of the centers, which also works when they all coincide
+		Vec3 extent = centers.max - centers.min;
+		uint32_t axis = extent.x > extent.y && extent.x > extent.z ? 0 : extent.y > extent.z ? 1 : 2;
+		auto middle = references.begin() + count / 2;
+
+		std::nth_element(references.begin(), middle, references.end(), [axis](const BuildReference& value, const BuildReference& other)
+		{
+			return get_axis(get_center(value), axis) < get_axis(get_center(other), axis);
+		});
+
+		left.assign(references.begin(), middle);
+		right.assign(middle, references.end());
+	}
+
+	references = {};
+
+	uint32_t child = static_cast<uint32_t>(context.nodes.size());
+	context.nodes.emplace_back();
+	context.nodes.emplace_back();
+	context.nodes[index].index = child;
+	context.nodes[index].count = 0;
+
+	build_node(context, child, std::move(left), depth + 1);
+	build_node(context, child + 1, std::move(right), depth + 1);
+}
+
+static float get_area(const BVHNode& node)
+{
+	Bounds bounds;
+	bounds.extend(node.min, node.max);
+	return bounds.get_area();
+}
+
+void BVH::build(const std::vector<PrimitiveID>& primitives, const std::vector<Vec3>& mins, const std::vector<Vec3>& maxs, const BVHSettings& settings)
+{
+	clear();
+	if (settings.layout == BVHLayout::None || primitives.empty()) return;
+	if (primitives.size() != mins.size() || primitives.size() != maxs.size()) throw std::invalid_argument("Bounds do not match primitives.");
+	if (settings.lazy_size > 0 && primitives.size() > settings.lazy_size) return build_lazy(primitives, mins, maxs, settings);
+
+	std::vector<BuildReference> build_references(primitives.size());
+	Bounds root;
+
+	for (size_t i = 0; i < primitives.size(); ++i)
+	{
+		build_references[i] = { mins[i], maxs[i], primitives[i] };
+		root.extend(mins[i], maxs[i]);
+	}
+
+	BuildContext context{ nodes, references };
+	context.root_area = root.get_area();
+	context.duplicates_left = static_cast<size_t>(static_cast<double>(primitives.size()) * std::max(settings.split_budget, 0.0f));
+
+	//The unused second node makes every pair of children start at an even index
+	nodes.reserve(primitives.size() * 2);
+	references.reserve(primitives.size());
+	nodes.resize(2);
+	build_node(context, 0, std::move(build_references), 0);
+	nodes.shrink_to_fit();
+	references.shrink_to_fit();
+
+	double root_area = get_area(nodes[0]);
+	sah_cost = 0.0;
+
+	for (size_t i = 0; i < nodes.size(); ++i)
+	{
+		if (i == 1) continue;
+		double probability = root_area > 0.0 ? get_area(nodes[i]) / root_area : 1.0;
+		sah_cost += probability * (nodes[i].count == 0 ? TraversalCost : static_cast<double>(nodes[i].count));
+	}
+
+	layout = settings.layout;
+	if (settings.treelets) reorder_treelets();
+	if (layout == BVHLayout::Compressed) compress();
+}
+
+/**
+ * Splits a range of references at the median of the longest axis of their centers, until every part holds at most a number of them.
+ * This is much cheaper than surface area heuristic splits, and only decides which subtree of a lazy hierarchy a reference falls in.
+ */
+static void split_subtrees(std::vector<BuildReference>& references, size_t begin, size_t end, size_t size, std::vector<std::pair<size_t, size_t>>& parts)
+{
+	if (end - begin <= size)
+	{
+		parts.emplace_back(begin, end);
+		return;
+	}
+
+	Bounds centers;
+
+	for (size_t i = begin; i < end; ++i)
+	{
+		Vec3 center = get_center(references[i]);
+		centers.extend(center, center);
+	}
+
+	Vec3 extent = centers.max - centers.min;
+	uint32_t axis = extent.x > extent.y && extent.x > extent.z ? 0 : extent.y > extent.z ? 1 : 2;
+	size_t middle = begin + (end - begin) / 2;
+
+	std::nth_element(references.begin() + begin, references.begin() + middle, references.begin() + end, [axis](const BuildReference& value, const BuildReference& other)
+	{
+		return get_axis(get_center(value), axis) < get_axis(get_center(other), axis);
+	});
+
+	split_subtrees(references, begin, middle, size, parts);
+	split_subtrees(references, middle, end, size, parts);
+}
+
+void BVH::build_lazy(const std::vector<PrimitiveID>& primitives, const std::vector<Vec3>& mins, const std::vector<Vec3>& maxs, const BVHSettings& settings)
+{
+	std::vector<BuildReference> build_references(primitives.size());
+	for (size_t i = 0; i < primitives.size(); ++i) build_references[i] = { mins[i], maxs[i], primitives[i] };
+
+	std::vector<std::pair<size_t, size_t>> parts;
+	split_subtrees(build_references, 0, build_references.size(), settings.lazy_size, parts);
+
+	std::vector<std::unique_ptr<Subtree>> new_subtrees;
+	std::vector<PrimitiveID> indices;
+	std::vector<Vec3> subtree_mins;
+	std::vector<Vec3> subtree_maxs;
+
+	for (auto [begin, end] : parts)
+	{
+		auto subtree = std::make_unique<Subtree>();
+		subtree->count = end - begin;
+		subtree->primitives.reserve(subtree->count);
+		subtree->mins.reserve(subtree->count);
+		subtree->maxs.reserve(subtree->count);
+		Bounds bounds;
+
+		for (size_t i = begin; i < end; ++i)
+		{
+			const BuildReference& reference = build_references[i];
+			subtree->primitives.push_back(reference.primitive);
+			subtree->mins.push_back(reference.min);
+			subtree->maxs.push_back(reference.max);
+			bounds.extend(reference.min, reference.max);
+		}
+
+		indices.push_back(static_cast<PrimitiveID>(new_subtrees.size()));
+		subtree_mins.push_back(bounds.min);
+		subtree_maxs.push_back(bounds.max);
+		new_subtrees.push_back(std::move(subtree));
+	}
+
+	build_references = {};
+
+	//The top levels are always binary, the layout and the other settings apply to the subtrees
+	build(indices, subtree_mins, subtree_maxs, {});
+	subtrees = std::move(new_subtrees);
+	subtree_settings = settings;
+	subtree_settings.lazy_size = 0;
+}
+
+void BVH::build_subtree(Subtree& subtree) const
+{
+	subtree.bvh.build(subtree.primitives, subtree.mins, subtree.maxs, subtree_settings);
+	subtree.primitives = {};
+	subtree.mins = {};
+	subtree.maxs = {};
+	subtree.built.store(true, std::memory_order_release);
+}
+
+void BVH::reorder_treelets()
+{
+	//Pairs of children are the unit of the layout: a cache line, visited together.
+	//A treelet is filled with the pairs most likely to be visited, those of the largest nodes, starting from its root pair,
+	//and the pairs that did not fit become the roots of the next treelets. The first treelet holds the hot top levels.
+	//The nodes are aligned to a page by allocate_large, and a treelet only fills up to the next page boundary so that it
+	//never straddles two pages: the first one shares its page with the root, and one after a small treelet gets the rest.
+	constexpr size_t PagePairs = PageSize / (sizeof(BVHNode) * 2);
+	if (nodes[0].count > 0) return;
+
+	std::vector<uint32_t> order; //The first index of every pair in the new order
+	order.reserve(nodes.size() / 2);
+
+	std::vector<uint32_t> roots = { nodes[0].index };
+
+	while (not roots.empty())
+	{
+		std::priority_queue<std::pair<float, uint32_t>> candidates;
+		candidates.emplace(Infinity, roots.back());
+		roots.pop_back();
+		size_t treelet = order.size();
+		size_t room = PagePairs - (treelet + 1) % PagePairs; //The root and its unused sibling take the first pair of the nodes
+
+		for (size_t size = 0; size < room && not candidates.empty(); ++size)
+		{
+			uint32_t pair = candidates.top().second;
+			candidates.pop();
+			order.push_back(pair);
+
+			for (uint32_t child = pair; child < pair + 2; ++child)
+			{
+				if (nodes[child].count == 0) candidates.emplace(get_area(nodes[child]), nodes[child].index);
+			}
+		}
+
+		//Within the treelet the pairs keep their depth first order, which often places a pair right after its parent
+		std::sort(order.begin() + treelet, order.end());
+
+		//The treelets below are laid out depth first right after this one, the most likely first,
+		//so that like a depth first order every subtree stays within a contiguous range of pages
+		size_t first = roots.size();
+
+		while (not candidates.empty())
+		{
+			roots.push_back(candidates.top().second);
+			candidates.pop();
+		}
+
+		std::reverse(roots.begin() + first, roots.end());
+	}
+
+	std::vector<uint32_t> positions(nodes.size());
+	for (size_t i = 0; i < order.size(); ++i) positions[order[i]] = static_cast<uint32_t>(2 + i * 2);
+
+	BVHNodes reordered(nodes.size());
+	reordered[0] = nodes[0];
+
+	for (uint32_t pair : order)
+	{
+		reordered[positions[pair]] = nodes[pair];
+		reordered[positions[pair] + 1] = nodes[pair + 1];
+	}
+
+	for (BVHNode& node : reordered)
+	{
+		if (node.count == 0 && node.index != 0) node.index = positions[node.index];
+	}
+
+	nodes = std::move(reordered);
+}
+
+void BVH::clear()
+{
+	layout = BVHLayout::None;
+	nodes = {};
+	compressed_nodes = {};
+	references = {};
+	sah_cost = 0.0;
+	subtrees.clear();
+	subtree_settings = {};
+}
+
+size_t BVH::get_node_count() const
+{
+	size_t count = layout == BVHLayout::Compressed ? compressed_nodes.size() : nodes.size();
+
+	for (const std::unique_ptr<Subtree>& subtree : subtrees)
+	{
+		if (subtree->built.load(std::memory_order_acquire)) count += subtree->bvh.get_node_count();
+	}
+
+	return count;
+}
+
+size_t BVH::get_reference_count() const
+{
+	size_t count = references.size();
+
+	for (const std::unique_ptr<Subtree>& subtree : subtrees)
+	{
+		if (subtree->built.load(std::memory_order_acquire)) count += subtree->bvh.get_reference_count();
+	}
+
+	return count;
+}
+
+size_t BVH::get_built_subtree_count() const
+{
+	return std::count_if(subtrees.begin(), subtrees.end(), [](const std::unique_ptr<Subtree>& subtree) { return subtree->built.load(std::memory_order_acquire); });
+}
+
+size_t BVH::get_bytes() const
+{
+	size_t bytes = nodes.size() * sizeof(BVHNode) + compressed_nodes.size() * sizeof(CompressedNode) + references.size() * sizeof(PrimitiveID);
+
+	for (const std::unique_ptr<Subtree>& subtree : subtrees)
+	{
+		if (subtree->built.load(std::memory_order_acquire)) bytes += subtree->bvh.get_bytes();
+		else bytes += subtree->count * (sizeof(PrimitiveID) + sizeof(Vec3) * 2);
+	}
+
+	return bytes;
+}
+
+/**
+ * Finds the quantized bounds of a child along an axis, rounded outwards with the exact arithmetic the traversal decodes them with.
+ * @return Whether the upper bound fits in 8 bits.
+ */
+static bool quantize(float origin, float step, float min, float max, uint8_t& lower, uint8_t& upper)
+{
+	auto decode = [&](uint32_t value) { return origin + static_cast<float>(value) * step; };
+
+	uint32_t low = static_cast<uint32_t>(std::max(std::floor((min - origin) / step), 0.0f));
+	while (low > 0 && decode(low) > min) --low;
+
+	float high_estimate = std::ceil((max - origin) / step);
+	if (not (high_estimate <= 255.0f)) return false;
+	uint32_t high = static_cast<uint32_t>(std::max(high_estimate, 0.0f));
+	while (high <= 255 && decode(high) < max) ++high;
+	if (high > 255 || low > high) return false;
+
+	lower = static_cast<uint8_t>(low);
+	upper = static_cast<uint8_t>(high);
+	return true;
+}
+
+/**
+ * Converts the binary node at an index into the compressed node at another index, then recursively its inner children.
+ * The up to four children are found by opening the inner children with the largest area.
+ */
+static void compress_node(const BVHNodes& nodes, const LargeVector<PrimitiveID>& references, LargeVector<CompressedNode>& compressed_nodes,
+                          LargeVector<PrimitiveID>& compressed_references, uint32_t binary, uint32_t index)
+{
+	const BVHNode& parent = nodes[binary];
+	uint32_t children[4];
+	uint32_t count = 0;
+
+	if (parent.count > 0) children[count++] = binary; //A leaf root becomes the only child
+	else
+	{
+		children[count++] = parent.index;
+		children[count++] = parent.index + 1;
+	}
+
+	while (count < 4)
+	{
+		uint32_t largest = count;
+		float largest_area = -1.0f;
+
+		for (uint32_t i = 0; i < count; ++i)
+		{
+			const BVHNode& child = nodes[children[i]];
+			if (child.count > 0 || get_area(child) <= largest_area) continue;
+			largest = i;
+			largest_area = get_area(child);
+		}
+
+		if (largest == count) break;
+		uint32_t opened = nodes[children[largest]].index;
+		children[largest] = opened;
+		children[count++] = opened + 1;
+	}
+
+	CompressedNode node;
+	node.origin = parent.min;
+	node.child_base = static_cast<uint32_t>(compressed_nodes.size());
+	node.reference_base = static_cast<uint32_t>(compressed_references.size());
+
+	for (uint32_t axis = 0; axis < 3; ++axis)
+	{
+		float origin = get_axis(parent.min, axis);
+		float extent = get_axis(parent.max, axis) - origin;
+		int exponent = extent > 0.0f ? static_cast<int>(std::ceil(std::log2(extent / 255.0f))) : -126;
+		exponent = std::max(exponent, -126);
+
+		//Rounding can push the upper bound past 255, which a larger step always fixes
+		while (true)
+		{
+			if (exponent > 127) throw std::runtime_error("Bounds too large to compress.");
+
+			float step = get_quantization_step(static_cast<int8_t>(exponent));
+			bool fits = true;
+
+			for (uint32_t i = 0; i < count && fits; ++i)
+			{
+				const BVHNode& child = nodes[children[i]];
+				fits = quantize(origin, step, get_axis(child.min, axis), get_axis(child.max, axis), node.lower[axis][i], node.upper[axis][i]);
+			}
+
+			if (fits) break;
+			++exponent;
+		}
+
+		node.exponents[axis] = static_cast<int8_t>(exponent);
+	}
+
+	uint32_t inner_count = 0;
+
+	for (uint32_t i = 0; i < count; ++i)
+	{
+		const BVHNode& child = nodes[children[i]];
+
+		if (child.count == 0)
+		{
+			node.inner_mask |= static_cast<uint8_t>(1 << i);
+			++inner_count;
+			continue;
+		}
+
+		uint32_t offset = static_cast<uint32_t>(compressed_references.size()) - node.reference_base;
+		if (offset > 31 || child.count > 7) throw std::runtime_error("Leaf too large to compress.");
+
+		node.meta[i] = static_cast<uint8_t>(offset << 3 | child.count);
+		compressed_references.insert(compressed_references.end(), references.begin() + child.index, references.begin() + child.index + child.count);
+	}
+
+	compressed_nodes.resize(compressed_nodes.size() + inner_count);
+	compressed_nodes[index] = node;
+
+	uint32_t inner_index = node.child_base;
+
+	for (uint32_t i = 0; i < count; ++i)
+	{
+		if (nodes[children[i]].count > 0) continue;
+		compress_node(nodes, references, compressed_nodes, compressed_references, children[i], inner_index++);
+	}
+}
+
+void BVH::compress()
+{
+	LargeVector<PrimitiveID> compressed_references;
+	compressed_references.reserve(references.size());
+	compressed_nodes.resize(1);
+
+	compress_node(nodes, references, compressed_nodes, compressed_references, 0, 0);
+
+	compressed_nodes.shrink_to_fit();
+	references = std::move(compressed_references);
+	nodes = {};
+}
@@ -0,0 +1,334 @@
+#include "library.hpp"
+
+#include <fstream>
+#include <cstring>
+#include <stdexcept>
+#include <algorithm>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+constexpr char ChunkMagic[8] = { 'C', 'H', 'U', 'N', 'K', 'S', '0', '1' };
+
+struct ChunkFileHeader
+{
+	char magic[8];
+	uint64_t chunk_count;
+};
+
+struct ChunkFileEntry
+{
+	Vec3 min;
+	uint32_t sphere_count;
+	Vec3 max;
+	uint32_t box_count;
+	uint64_t offset; //Of the spheres of the chunk, followed by its boxes, aligned to PageSize
+};
+
+static size_t get_chunk_bytes(uint32_t sphere_count, uint32_t box_count)
+{
+	return sphere_count * sizeof(SphereRecord) + box_count * sizeof(BoxRecord);
+}
+
+/**
+ * Splits the primitives between two iterators at the median of the longest axis of their centers
+ * until there are at most a number of them, which then form a chunk.
+ */
+template<class Iterator>
+static void split_chunks(Iterator begin, Iterator end, uint32_t chunk_primitives, std::vector<std::vector<PrimitiveID>>& chunks)
+{
+	if (static_cast<size_t>(end - begin) <= chunk_primitives)
+	{
+		std::vector<PrimitiveID>& chunk = chunks.emplace_back();
+		for (Iterator current = begin; current != end; ++current) chunk.push_back(current->first);
+		return;
+	}
+
+	Vec3 min(Infinity);
+	Vec3 max(-Infinity);
+
+	for (Iterator current = begin; current != end; ++current)
+	{
+		min = Vec3(std::min(min.x, current->second.x), std::min(min.y, current->second.y), std::min(min.z, current->second.z));
+		max = Vec3(std::max(max.x, current->second.x), std::max(max.y, current->second.y), std::max(max.z, current->second.z));
+	}
+
+	Vec3 extent = max - min;
+	int axis = extent.x > extent.y && extent.x > extent.z ? 0 : extent.y > extent.z ? 1 : 2;
+	auto get_axis = [axis](Vec3 value) { return axis == 0 ? value.x : axis == 1 ? value.y : value.z; };
+
+	Iterator middle = begin + (end - begin) / 2;
+	std::nth_element(begin, middle, end, [&](const auto& value, const auto& other) { return get_axis(value.second) < get_axis(other.second); });
+
+	split_chunks(begin, middle, chunk_primitives, chunks);
+	split_chunks(middle, end, chunk_primitives, chunks);
+}
+
+void OutOfCoreScene::write(const Scene& scene, const std::string& filename, uint32_t chunk_primitives)
+{
+	if (chunk_primitives == 0) throw std::invalid_argument("Empty chunks.");
+	if (not scene.particles.empty()) throw std::invalid_argument("Particles cannot be chunked.");
+
+	std::vector<std::pair<PrimitiveID, Vec3>> centers;
+	centers.reserve(scene.spheres.size() + scene.boxes.size());
+
+	for (size_t i = 0; i < scene.spheres.size(); ++i) centers.emplace_back(make_primitive_id(PrimitiveKind::Sphere, i), std::get<0>(scene.spheres[i]));
+
+	for (size_t i = 0; i < scene.boxes.size(); ++i)
+	{
+		auto& [min, max, material] = scene.boxes[i];
+		centers.emplace_back(make_primitive_id(PrimitiveKind::Box, i), (min + max) / 2.0f);
+	}
+
+	std::vector<std::vector<PrimitiveID>> chunks;
+	if (not centers.empty()) split_chunks(centers.begin(), centers.end(), chunk_primitives, chunks);
+	centers = {};
+
+	std::ofstream stream(filename, std::ios::binary);
+	ChunkFileHeader header;
+	std::memcpy(header.magic, ChunkMagic, sizeof(ChunkMagic));
+	header.chunk_count = chunks.size();
+	stream.write(reinterpret_cast<const char*>(&header), sizeof(header));
+
+	//The entries are written first, so the primitives start at the page after them
+	size_t offset = sizeof(ChunkFileHeader) + chunks.size() * sizeof(ChunkFileEntry);
+
+	for (std::vector<PrimitiveID>& chunk : chunks)
+	{
+		//Spheres first, then boxes, since primitive IDs sort by kind
+		std::sort(chunk.begin(), chunk.end());
+
+		ChunkFileEntry entry{ Vec3(Infinity), 0, Vec3(-Infinity), 0, (offset + PageSize - 1) / PageSize * PageSize };
+
+		for (PrimitiveID primitive : chunk)
+		{
+			Vec3 min;
+			Vec3 max;
+			scene.get_bounds(primitive, min, max);
+			entry.min = Vec3(std::min(entry.min.x, min.x), std::min(entry.min.y, min.y), std::min(entry.min.z, min.z));
+			entry.max = Vec3(std::max(entry.max.x, max.x), std::max(entry.max.y, max.y), std::max(entry.max.z, max.z));
+			++(get_primitive_kind(primitive) == PrimitiveKind::Sphere ? entry.sphere_count : entry.box_count);
+		}
+
+		stream.write(reinterpret_cast<const char*>(&entry), sizeof(entry));
+		offset = entry.offset + get_chunk_bytes(entry.sphere_count, entry.box_count);
+	}
+
+	for (const std::vector<PrimitiveID>& chunk : chunks)
+	{
+		size_t position = static_cast<size_t>(stream.tellp());
+		size_t padding = (position + PageSize - 1) / PageSize * PageSize - position;
+		std::fill_n(std::ostreambuf_iterator<char>(stream), padding, '\0');
+
+		for (PrimitiveID primitive : chunk)
+		{
+			uint32_t index = get_primitive_index(primitive);
+
+			if (get_primitive_kind(primitive) == PrimitiveKind::Sphere)
+			{
+				auto& [center, radius, material] = scene.spheres[index];
+				SphereRecord record{ center, radius, material };
+				stream.write(reinterpret_cast<const char*>(&record), sizeof(record));
+			}
+			else
+			{
+				auto& [min, max, material] = scene.boxes[index];
+				BoxRecord record{ min, max, material };
+				stream.write(reinterpret_cast<const char*>(&record), sizeof(record));
+			}
+		}
+	}
+
+	if (not stream) throw std::runtime_error("Error in when outputting chunks.");
+}
+
+OutOfCoreScene::OutOfCoreScene(const std::string& filename, const Scene& scene, size_t budget, const BVHSettings& settings)
+	: settings(settings), budget(budget)
+{
+	planes.planes = scene.planes;
+
+	file = open(filename.c_str(), O_RDONLY);
+	if (file < 0) throw std::runtime_error("Error in when reading chunks: " + filename);
+
+	struct stat status;
+	fstat(file, &status);
+	mapping_size = static_cast<size_t>(status.st_size);
+
+	void* pointer = mapping_size < sizeof(ChunkFileHeader) ? MAP_FAILED : mmap(nullptr, mapping_size, PROT_READ, MAP_PRIVATE, file, 0);
+
+	if (pointer == MAP_FAILED)
+	{
+		close(file);
+		throw std::runtime_error("Error in when reading chunks: " + filename);
+	}
+
+	mapping = static_cast<std::byte*>(pointer);
+	ChunkFileHeader header;
+	std::memcpy(&header, mapping, sizeof(header));
+
+	bool valid = std::memcmp(header.magic, ChunkMagic, sizeof(ChunkMagic)) == 0 &&
+	             header.chunk_count <= (mapping_size - sizeof(header)) / sizeof(ChunkFileEntry);
+
+	for (size_t i = 0; valid && i < header.chunk_count; ++i)
+	{
+		ChunkFileEntry entry;
+		std::memcpy(&entry, mapping + sizeof(header) + i * sizeof(ChunkFileEntry), sizeof(entry));
+		valid = entry.offset % PageSize == 0 && entry.offset + get_chunk_bytes(entry.sphere_count, entry.box_count) <= mapping_size;
+
+		Chunk& chunk = chunks.emplace_back();
+		chunk.min = entry.min;
+		chunk.max = entry.max;
+		chunk.offset = entry.offset;
+		chunk.sphere_count = entry.sphere_count;
+		chunk.box_count = entry.box_count;
+	}
+
+	if (not valid)
+	{
+		munmap(mapping, mapping_size);
+		close(file);
+		throw std::runtime_error("Invalid chunks: " + filename);
+	}
+
+	std::vector<PrimitiveID> primitives(chunks.size());
+	std::vector<Vec3> mins(chunks.size());
+	std::vector<Vec3> maxs(chunks.size());
+
+	for (size_t i = 0; i < chunks.size(); ++i)
+	{
+		primitives[i] = static_cast<PrimitiveID>(i);
+		mins[i] = chunks[i].min;
+		maxs[i] = chunks[i].max;
+	}
+
+	if (not chunks.empty()) chunk_bvh.build(primitives, mins, maxs, {});
+}
+
+OutOfCoreScene::~OutOfCoreScene()
+{
+	munmap(mapping, mapping_size);
+	close(file);
+}
+
+void OutOfCoreScene::page_in(Chunk& chunk)
+{
+	//Evicts first with an estimate of the memory of the chunk, so the budget also bounds the peak
+	size_t count = chunk.sphere_count + chunk.box_count;
+	size_t estimate = chunk.resident_bytes;
+	if (estimate == 0) estimate = get_chunk_bytes(chunk.sphere_count, chunk.box_count) + count * (sizeof(PrimitiveID) + sizeof(BVHNode));
+
+	while (resident_bytes + estimate > budget)
+	{
+		Chunk* oldest = nullptr;
+
+		for (Chunk& other : chunks)
+		{
+			if (other.scene == nullptr || &other == &chunk) continue;
+			if (oldest == nullptr || other.last_batch < oldest->last_batch) oldest = &other;
+		}
+
+		if (oldest == nullptr) break;
+		evict(*oldest);
+	}
+
+	std::byte* data = mapping + chunk.offset;
+	size_t bytes = get_chunk_bytes(chunk.sphere_count, chunk.box_count);
+	madvise(data, bytes, MADV_WILLNEED);
+
+	auto scene = std::make_unique<Scene>();
+	scene->spheres.resize(chunk.sphere_count);
+	scene->boxes.resize(chunk.box_count);
+
+	for (uint32_t i = 0; i < chunk.sphere_count; ++i)
+	{
+		SphereRecord record;
+		std::memcpy(&record, data + i * sizeof(SphereRecord), sizeof(record));
+		scene->spheres[i] = { record.center, record.radius, record.material };
+	}
+
+	const std::byte* box_data = data + chunk.sphere_count * sizeof(SphereRecord);
+
+	for (uint32_t i = 0; i < chunk.box_count; ++i)
+	{
+		BoxRecord record;
+		std::memcpy(&record, box_data + i * sizeof(BoxRecord), sizeof(record));
+		scene->boxes[i] = { record.min, record.max, record.material };
+	}
+
+	//The primitives were copied into the scene, so the pages of the file do not need to stay mapped in
+	madvise(data, bytes, MADV_DONTNEED);
+	scene->build_bvh(settings);
+
+	chunk.resident_bytes = scene->spheres.size() * sizeof(scene->spheres[0]) + scene->boxes.size() * sizeof(scene->boxes[0]) + scene->get_bvh().get_bytes();
+	chunk.scene = std::move(scene);
+	resident_bytes += chunk.resident_bytes;
+	peak_resident_bytes = std::max(peak_resident_bytes, resident_bytes);
+	++page_ins;
+}
+
+void OutOfCoreScene::evict(Chunk& chunk)
+{
+	resident_bytes -= chunk.resident_bytes;
+	chunk.scene.reset();
+}
+
+void OutOfCoreScene::intersect(const Ray* rays, size_t count, RayHit* hits)
+{
+	++batch;
+	for (Chunk& chunk : chunks) chunk.queue.clear();
+
+	for (size_t i = 0; i < count; ++i)
+	{
+		const Ray& ray = rays[i];
+		RayHit& hit = hits[i];
+		planes.intersect(ray, hit.distance, hit.normal, hit.material);
+
+		Vec3 inverse_direction = Vec3(1.0f) / ray.direction;
+		float limit = hit.distance;
+
+		chunk_bvh.traverse(ray, limit, [&](PrimitiveID index)
+		{
+			Chunk& chunk = chunks[index];
+			float entry = intersect_bounds(ray.origin, inverse_direction, chunk.min, chunk.max, hit.distance);
+			if (entry != Infinity) chunk.queue.emplace_back(static_cast<uint32_t>(i), entry);
+		});
+	}
+
+	//Resident chunks go first because they are free, then the ones with the most rays waiting
+	order.clear();
+
+	for (uint32_t i = 0; i < chunks.size(); ++i)
+	{
+		if (not chunks[i].queue.empty()) order.push_back(i);
+	}
+
+	std::sort(order.begin(), order.end(), [&](uint32_t index, uint32_t other)
+	{
+		const Chunk& chunk = chunks[index];
+		const Chunk& other_chunk = chunks[other];
+		bool resident = chunk.scene != nullptr;
+		if (resident != (other_chunk.scene != nullptr)) return resident;
+		return chunk.queue.size() > other_chunk.queue.size();
+	});
+
+	for (uint32_t index : order)
+	{
+		Chunk& chunk = chunks[index];
+		if (chunk.scene == nullptr) page_in(chunk);
+		chunk.last_batch = batch;
+
+		//A ray is queued at most once per chunk, so the threads never write to the same hit
+		parallel_for(0, static_cast<uint32_t>(chunk.queue.size()), [&](uint32_t queued)
+		{
+			auto [ray_index, entry] = chunk.queue[queued];
+			RayHit& hit = hits[ray_index];
+			if (entry >= hit.distance) return;
+
+			RayHit new_hit;
+			if (not chunk.scene->intersect(rays[ray_index], new_hit.distance, new_hit.normal, new_hit.material)) return;
+			if (new_hit.distance < hit.distance) hit = new_hit;
+		});
+	}
+}
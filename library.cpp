@@ -1,4 +1,5 @@
 #include "library.hpp"
+#include "profile.hpp"
 
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 
@@ -9,18 +10,271 @@
 #include <random>
 #include <thread>
 #include <atomic>
+#include <latch>
+#include <fstream>
 #include <iostream>
 
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
+
 using Random = std::default_random_engine;
 thread_local std::unique_ptr<Random> thread_random;
 
-void Scene::insert_box(Vec3 center, Vec3 size, uint32_t material)
+static std::atomic<HugePages> huge_pages = HugePages::Off;
+
+void set_huge_pages(HugePages mode) { huge_pages = mode; }
+
+HugePages get_huge_pages() { return huge_pages; }
+
+size_t get_huge_page_bytes()
+{
+	std::ifstream stream("/proc/self/smaps_rollup");
+	std::string line;
+	size_t bytes = 0;
+
+	while (std::getline(stream, line))
+	{
+		//Transparent huge pages are counted as AnonHugePages, explicit ones as Private_Hugetlb
+		if (not line.starts_with("AnonHugePages:") && not line.starts_with("Private_Hugetlb:")) continue;
+		bytes += std::stoull(line.substr(line.find(':') + 1)) * 1024;
+	}
+
+	return bytes;
+}
+
+//Whole pages are aligned to a page, so that layouts made of page sized blocks such as BVH treelets line up with the pages
+static size_t get_large_alignment(size_t bytes) { return bytes >= PageSize ? PageSize : CacheLineSize; }
+
+void* allocate_large(size_t bytes)
+{
+#ifdef __linux__
+	if (bytes >= LargeAllocationSize)
+	{
+		size_t size = (bytes + HugePageSize - 1) / HugePageSize * HugePageSize;
+		HugePages mode = huge_pages;
+
+		if (mode == HugePages::Off)
+		{
+			//Starts one page into a heap block, or two if that is aligned to a huge page, so that free_large tells it apart
+			//from a mapping even when the mode changed in between. The word before the allocation holds how far in it starts.
+			auto block = static_cast<std::byte*>(::operator new(bytes + 2 * PageSize, std::align_val_t(PageSize)));
+			std::byte* pointer = block + PageSize;
+			if (reinterpret_cast<uintptr_t>(pointer) % HugePageSize == 0) pointer += PageSize;
+			reinterpret_cast<size_t*>(pointer)[-1] = static_cast<size_t>(pointer - block);
+			return pointer;
+		}
+
+		if (mode == HugePages::Explicit)
+		{
+			void* pointer = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+			if (pointer != MAP_FAILED) return pointer;
+		}
+
+		//Maps an extra huge page to cut a region aligned to huge pages out of, otherwise the kernel cannot use them at the edges
+		void* mapping = mmap(nullptr, size + HugePageSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (mapping == MAP_FAILED) throw std::bad_alloc();
+
+		uintptr_t begin = reinterpret_cast<uintptr_t>(mapping);
+		uintptr_t aligned = (begin + HugePageSize - 1) / HugePageSize * HugePageSize;
+		if (aligned > begin) munmap(mapping, aligned - begin);
+		munmap(reinterpret_cast<void*>(aligned + size), begin + HugePageSize - aligned);
+
+		void* pointer = reinterpret_cast<void*>(aligned);
+		madvise(pointer, size, MADV_HUGEPAGE);
+		return pointer;
+	}
+#endif
+
+	return ::operator new(bytes, std::align_val_t(get_large_alignment(bytes)));
+}
+
+void free_large(void* pointer, size_t bytes)
+{
+#ifdef __linux__
+	if (bytes >= LargeAllocationSize)
+	{
+		auto address = static_cast<std::byte*>(pointer);
+
+		if (reinterpret_cast<uintptr_t>(address) % HugePageSize != 0)
+		{
+			::operator delete(address - reinterpret_cast<size_t*>(address)[-1], std::align_val_t(PageSize));
+			return;
+		}
+
+		//Both kinds of mappings span the same whole huge pages
+		munmap(pointer, (bytes + HugePageSize - 1) / HugePageSize * HugePageSize);
+		return;
+	}
+#endif
+
+	::operator delete(pointer, std::align_val_t(get_large_alignment(bytes)));
+}
+
+PrimitiveID Scene::insert_box(Vec3 center, Vec3 size, uint32_t material)
 {
 	Vec3 extend = size / 2.0f;
+	bvh.clear();
 	boxes.emplace_back(center - extend, center + extend, material);
+	return make_primitive_id(PrimitiveKind::Box, boxes.size() - 1);
+}
+
+void Scene::set_material(PrimitiveID primitive, uint32_t material)
+{
+	uint32_t index = get_primitive_index(primitive);
+
+	switch (get_primitive_kind(primitive))
+	{
+		case PrimitiveKind::Sphere: std::get<2>(spheres.at(index)) = material; break;
+		case PrimitiveKind::Plane: std::get<2>(planes.at(index)) = material; break;
+		case PrimitiveKind::Box: std::get<2>(boxes.at(index)) = material; break;
+		case PrimitiveKind::Particles: particles.at(index).material = material; break;
+		default: throw std::out_of_range("Invalid primitive.");
+	}
+}
+
+void Scene::translate(PrimitiveID primitive, Vec3 offset)
+{
+	if (get_primitive_kind(primitive) != PrimitiveKind::Plane) bvh.clear();
+	uint32_t index = get_primitive_index(primitive);
+
+	switch (get_primitive_kind(primitive))
+	{
+		case PrimitiveKind::Sphere:
+		{
+			Vec3& center = std::get<0>(spheres.at(index));
+			center = center + offset;
+			break;
+		}
+		case PrimitiveKind::Plane:
+		{
+			auto& [normal, distance, material] = planes.at(index);
+			distance -= dot(normal, offset);
+			break;
+		}
+		case PrimitiveKind::Box:
+		{
+			auto& [min, max, material] = boxes.at(index);
+			min = min + offset;
+			max = max + offset;
+			break;
+		}
+		case PrimitiveKind::Particles:
+		{
+			ParticleLeaf& leaf = particles.at(index);
+			leaf.origin = leaf.origin + offset;
+			break;
+		}
+		default: throw std::out_of_range("Invalid primitive.");
+	}
+}
+
+bool Scene::get_bounds(PrimitiveID primitive, Vec3& min, Vec3& max) const
+{
+	uint32_t index = get_primitive_index(primitive);
+
+	switch (get_primitive_kind(primitive))
+	{
+		case PrimitiveKind::Sphere:
+		{
+			auto& [center, radius, material] = spheres.at(index);
+			min = center - Vec3(radius);
+			max = center + Vec3(radius);
+			return true;
+		}
+		case PrimitiveKind::Plane:
+		{
+			min = Vec3(-Infinity);
+			max = Vec3(Infinity);
+			return false;
+		}
+		case PrimitiveKind::Box:
+		{
+			min = std::get<0>(boxes.at(index));
+			max = std::get<1>(boxes.at(index));
+			return true;
+		}
+		case PrimitiveKind::Particles:
+		{
+			get_particle_bounds(particles.at(index), min, max);
+			return true;
+		}
+		default: throw std::out_of_range("Invalid primitive.");
+	}
+}
+
+void Scene::build_bvh(const BVHSettings& settings)
+{
+	std::vector<PrimitiveID> primitives;
+	std::vector<Vec3> mins;
+	std::vector<Vec3> maxs;
+
+	primitives.reserve(spheres.size() + boxes.size() + particles.size());
+	mins.reserve(primitives.capacity());
+	maxs.reserve(primitives.capacity());
+
+	auto add = [&](PrimitiveID primitive)
+	{
+		Vec3 min;
+		Vec3 max;
+		get_bounds(primitive, min, max);
+		primitives.push_back(primitive);
+		mins.push_back(min);
+		maxs.push_back(max);
+	};
+
+	for (size_t i = 0; i < spheres.size(); ++i) add(make_primitive_id(PrimitiveKind::Sphere, i));
+	for (size_t i = 0; i < boxes.size(); ++i) add(make_primitive_id(PrimitiveKind::Box, i));
+	for (size_t i = 0; i < particles.size(); ++i) add(make_primitive_id(PrimitiveKind::Particles, i));
+	bvh.build(primitives, mins, maxs, settings);
+}
+
+uint64_t Scene::get_hash() const
+{
+	//FNV-1a over the bytes of every field, fields of Vec3 and the tuples are all four bytes wide so there is no padding
+	uint64_t hash = 14695981039346656037ULL;
+
+	auto add = [&](const auto& primitives)
+	{
+		for (const auto& primitive : primitives)
+		{
+			std::apply([&](const auto&... fields)
+			{
+				auto add_field = [&](const auto& field)
+				{
+					auto bytes = reinterpret_cast<const unsigned char*>(&field);
+					for (size_t i = 0; i < sizeof(field); ++i) hash = (hash ^ bytes[i]) * 1099511628211ULL;
+				};
+
+				(add_field(fields), ...);
+			}, primitive);
+		}
+
+		hash = (hash ^ primitives.size()) * 1099511628211ULL;
+	};
+
+	add(spheres);
+	add(planes);
+	add(boxes);
+
+	//A leaf is all four byte fields followed by the quantized arrays, so it has no padding either
+	for (const ParticleLeaf& leaf : particles)
+	{
+		auto bytes = reinterpret_cast<const unsigned char*>(&leaf);
+		for (size_t i = 0; i < sizeof(leaf); ++i) hash = (hash ^ bytes[i]) * 1099511628211ULL;
+	}
+
+	hash = (hash ^ particles.size()) * 1099511628211ULL;
+	return hash;
 }
 
-static float intersect_sphere(const Ray& ray, Vec3 center, float radius, Vec3& normal)
+size_t Scene::get_bytes() const
+{
+	return spheres.capacity() * sizeof(spheres[0]) + planes.capacity() * sizeof(planes[0]) + boxes.capacity() * sizeof(boxes[0]) +
+	       particles.capacity() * sizeof(ParticleLeaf) + bvh.get_bytes();
+}
+
+float intersect_sphere(const Ray& ray, Vec3 center, float radius, Vec3& normal)
 {
 	Vec3 offset = ray.origin - center;
 	float radius2 = radius * radius;
@@ -38,7 +292,7 @@ static float intersect_sphere(const Ray& ray, Vec3 center, float radius, Vec3& n
 	return distance;
 }
 
-static float intersect_plane(const Ray& ray, Vec3 normal, float offset)
+float intersect_plane(const Ray& ray, Vec3 normal, float offset)
 {
 	float mapped = dot(ray.direction, normal);
 
@@ -52,7 +306,7 @@ static float intersect_plane(const Ray& ray, Vec3 normal, float offset)
 	return Infinity;
 }
 
-static float intersect_box(const Ray& ray, Vec3 min, Vec3 max, Vec3& normal)
+float intersect_box(const Ray& ray, Vec3 min, Vec3 max, Vec3& normal)
 {
 	Vec3 direction_r = Vec3(1.0f) / ray.direction;
 	Vec3 lengths_min = (min - ray.origin) * direction_r;
@@ -113,14 +367,69 @@ static float intersect_box(const Ray& ray, Vec3 min, Vec3 max, Vec3& normal)
 	return Infinity;
 }
 
-bool Scene::intersect(const Ray& ray, float& distance, Vec3& normal, uint32_t& material) const
+bool Scene::intersect(const Ray& ray, float& distance, Vec3& normal, uint32_t& material, PrimitiveID& primitive) const
 {
 	distance = Infinity;
 
-	for (auto& sphere : spheres)
+	for (size_t i = 0; i < planes.size(); ++i)
 	{
-		Vec3 center = std::get<0>(sphere);
-		float radius = std::get<1>(sphere);
+		auto& [new_normal, offset, plane_material] = planes[i];
+		float new_distance = intersect_plane(ray, new_normal, offset);
+
+		if (new_distance < distance)
+		{
+			distance = new_distance;
+			normal = new_normal;
+			material = plane_material;
+			primitive = make_primitive_id(PrimitiveKind::Plane, i);
+		}
+	}
+
+	if (not bvh.empty())
+	{
+		STATISTIC(primitive_tests += planes.size());
+
+		bvh.traverse(ray, distance, [&](PrimitiveID id)
+		{
+			STATISTIC(primitive_tests += 1);
+			uint32_t index = get_primitive_index(id);
+			Vec3 new_normal;
+			float new_distance;
+			uint32_t new_material;
+
+			if (get_primitive_kind(id) == PrimitiveKind::Sphere)
+			{
+				auto& [center, radius, sphere_material] = spheres[index];
+				new_distance = intersect_sphere(ray, center, radius, new_normal);
+				new_material = sphere_material;
+			}
+			else if (get_primitive_kind(id) == PrimitiveKind::Particles)
+			{
+				new_distance = intersect_particles(ray, particles[index], distance, new_normal);
+				new_material = particles[index].material;
+			}
+			else
+			{
+				auto& [min, max, box_material] = boxes[index];
+				new_distance = intersect_box(ray, min, max, new_normal);
+				new_material = box_material;
+			}
+
+			if (new_distance >= distance) return;
+			distance = new_distance;
+			normal = new_normal;
+			material = new_material;
+			primitive = id;
+		});
+
+		return std::isfinite(distance);
+	}
+
+	STATISTIC(primitive_tests += spheres.size() + planes.size() + boxes.size() + particles.size());
+
+	for (size_t i = 0; i < spheres.size(); ++i)
+	{
+		auto& [center, radius, sphere_material] = spheres[i];
 
 		Vec3 new_normal;
 		float new_distance = intersect_sphere(ray, center, radius, new_normal);
@@ -129,51 +438,164 @@ bool Scene::intersect(const Ray& ray, float& distance, Vec3& normal, uint32_t& m
 		{
 			distance = new_distance;
 			normal = new_normal;
-			material = std::get<2>(sphere);
+			material = sphere_material;
+			primitive = make_primitive_id(PrimitiveKind::Sphere, i);
 		}
 	}
 
-	for (auto& plane : planes)
+	for (size_t i = 0; i < boxes.size(); ++i)
 	{
-		Vec3 new_normal = std::get<0>(plane);
-		float offset = std::get<1>(plane);
-		float new_distance = intersect_plane(ray, new_normal, offset);
+		auto& [min, max, box_material] = boxes[i];
+
+		Vec3 new_normal;
+		float new_distance = intersect_box(ray, min, max, new_normal);
 
 		if (new_distance < distance)
 		{
 			distance = new_distance;
 			normal = new_normal;
-			material = std::get<2>(plane);
+			material = box_material;
+			primitive = make_primitive_id(PrimitiveKind::Box, i);
 		}
 	}
 
-	for (auto& box : boxes)
+	for (size_t i = 0; i < particles.size(); ++i)
 	{
-		Vec3 min = std::get<0>(box);
-		Vec3 max = std::get<1>(box);
-
 		Vec3 new_normal;
-		float new_distance = intersect_box(ray, min, max, new_normal);
+		float new_distance = intersect_particles(ray, particles[i], distance, new_normal);
 
 		if (new_distance < distance)
 		{
 			distance = new_distance;
 			normal = new_normal;
-			material = std::get<2>(box);
+			material = particles[i].material;
+			primitive = make_primitive_id(PrimitiveKind::Particles, i);
 		}
 	}
 
 	return std::isfinite(distance);
 }
 
+void insert_procedural(Scene& scene, const ProceduralSettings& settings)
+{
+	if (settings.count == 0) return;
+	if (settings.materials.empty() || settings.emitters.empty()) throw std::invalid_argument("No materials to assign.");
+
+	//Not using std::uniform_real_distribution because its results differ between standard libraries
+	std::mt19937 random(settings.seed);
+	auto next_float = [&]() { return static_cast<float>(random() >> 8) * 0x1p-24f; };
+	auto next_material = [&](const std::vector<uint32_t>& materials) { return materials[random() % materials.size()]; };
+
+	Vec3 extend = settings.max - settings.min;
+	auto next_point = [&]() { return settings.min + extend * Vec3(next_float(), next_float(), next_float()); };
+
+	uint32_t count = settings.count;
+	float size = std::cbrt(extend.x * extend.y * extend.z / static_cast<float>(count)); //Edge of the volume available to every primitive
+
+	switch (settings.kind)
+	{
+		case ProceduralKind::Spheres:
+		case ProceduralKind::Emitters:
+		{
+			scene.reserve(count, 0, 0);
+
+			for (uint32_t i = 0; i < count; ++i)
+			{
+				Vec3 center = next_point();
+				float radius = size * (0.1f + 0.3f * next_float());
+				bool emitter = settings.kind == ProceduralKind::Emitters && i % 4 == 0;
+				scene.insert_sphere(center, radius, next_material(emitter ? settings.emitters : settings.materials));
+			}
+
+			break;
+		}
+		case ProceduralKind::Boxes:
+		{
+			scene.reserve(0, 0, count);
+
+			for (uint32_t i = 0; i < count; ++i)
+			{
+				Vec3 center = next_point();
+				Vec3 box_size = Vec3(next_float(), next_float(), next_float()) * (size * 0.6f) + Vec3(size * 0.1f);
+				scene.insert_box(center, box_size, next_material(settings.materials));
+			}
+
+			break;
+		}
+		case ProceduralKind::Grid:
+		{
+			auto side = static_cast<uint32_t>(std::ceil(std::cbrt(static_cast<float>(count))));
+			Vec3 cell = extend / static_cast<float>(side);
+			float radius = std::min({ cell.x, cell.y, cell.z }) * 0.35f;
+			scene.reserve(count - count / 2, 0, count / 2);
+
+			for (uint32_t i = 0; i < count; ++i)
+			{
+				Vec3 index(static_cast<float>(i % side), static_cast<float>(i / side % side), static_cast<float>(i / side / side));
+				Vec3 center = settings.min + cell * (index + Vec3(0.5f));
+				uint32_t material = next_material(settings.materials);
+
+				if (i % 2 == 0) scene.insert_sphere(center, radius, material);
+				else scene.insert_box(center, Vec3(radius * 1.6f), material);
+			}
+
+			break;
+		}
+		case ProceduralKind::Stack:
+		{
+			//Columns of slabs like the glass slabs of the reference scene, each one StackDepth slabs deep
+			constexpr uint32_t StackDepth = 64;
+			uint32_t stacks = (count + StackDepth - 1) / StackDepth;
+			auto side = static_cast<uint32_t>(std::ceil(std::sqrt(static_cast<float>(stacks))));
+			Vec3 cell(extend.x / static_cast<float>(side), extend.y / StackDepth, extend.z / static_cast<float>(side));
+			scene.reserve(0, 0, count);
+
+			for (uint32_t i = 0; i < count; ++i)
+			{
+				uint32_t stack = i / StackDepth;
+				Vec3 index(static_cast<float>(stack % side), static_cast<float>(i % StackDepth), static_cast<float>(stack / side));
+				Vec3 center = settings.min + cell * (index + Vec3(0.5f));
+				scene.insert_box(center, Vec3(cell.x * 0.9f, cell.y * 0.2f, cell.z * 0.9f), next_material(settings.materials));
+			}
+
+			break;
+		}
+		case ProceduralKind::Particles:
+		{
+			//One group of particles per material, all of the same radius
+			std::vector<Vec3> positions;
+			auto groups = static_cast<uint32_t>(settings.materials.size());
+
+			for (uint32_t group = 0; group < groups; ++group)
+			{
+				positions.resize(count / groups + (group < count % groups ? 1 : 0));
+				for (Vec3& position : positions) position = next_point();
+				scene.insert_particles(positions.data(), nullptr, positions.size(), size * 0.25f, settings.materials[group]);
+			}
+
+			break;
+		}
+		default: throw std::invalid_argument("Invalid procedural kind.");
+	}
+}
+
 static Random* make_random_engine(uint32_t seed)
 {
+	//Reseeding is cheap enough to restart the sequence at every bounce of a path, so the engine is kept
+	if (thread_random != nullptr)
+	{
+		thread_random->seed(seed);
+		return thread_random.get();
+	}
+
 	auto random = std::make_unique<Random>(seed);
 	Random* result = random.get();
 	thread_random = std::move(random);
 	return result;
 }
 
+void seed_random(uint32_t seed) { make_random_engine(seed); }
+
 float random_float()
 {
 	Random* random = thread_random.get();
@@ -252,29 +674,189 @@ Vec3 fresnel_refract(float eta, float cos_i, Vec3 outgoing, Vec3 normal)
 	return normalize(normal * (eta * cos_o + cos_i) - outgoing * eta);
 }
 
+Color bsdf_lambertian_reflection(Vec3 outgoing, Vec3 normal, Vec3& incident)
+{
+	//Uniform sampling
+	//	incident = random_on_sphere();
+	//	float pdf = 1.0f / Pi / 2.0f;
+
+	//Importance sampling based on cosine distribution
+	incident = random_cosine_hemisphere(normal);
+	float pdf = pdf_cosine_hemisphere(normal, incident);
+	if (almost_zero(pdf)) return Color();
+
+	make_same_side(outgoing, normal, incident);
+	float evaluated = 1.0f / Pi;
+	return Color(evaluated / pdf);
+}
+
+Color bsdf_specular_reflection(Vec3 outgoing, Vec3 normal, Vec3& incident)
+{
+	incident = reflect(outgoing, normal);
+	float correction = abs_dot(incident, normal);
+	if (almost_zero(correction)) return Color();
+	return Color(1.0f / correction);
+}
+
+Color bsdf_specular_fresnel(Vec3 outgoing, Vec3 normal, Vec3& incident, float eta)
+{
+	float cos_o = dot(outgoing, normal);
+	if (cos_o < 0.0f) eta = 1.0f / eta;
+
+	float cos_i = fresnel_cos_i(eta, cos_o);
+	float evaluated = fresnel_value(eta, cos_o, cos_i);
+
+	//Uniform sampling
+	//	if (random_float() < 0.5f)
+	//	{
+	//		//Specular reflection
+	//		incident = normalize(reflect(outgoing, normal));
+	//	}
+	//	else
+	//	{
+	//		//Specular transmission
+	//		evaluated = 1.0f - evaluated;
+	//		incident = fresnel_refract(eta, cos_i, outgoing, normal);
+	//	}
+	//
+	//	float correction = abs_dot(incident, normal);
+	//	if (almost_zero(correction)) return Color();
+	//	return Color(evaluated / correction / 0.5f);
+
+	//Importance sampling
+	if (random_float() < evaluated) incident = normalize(reflect(outgoing, normal));
+	else incident = fresnel_refract(eta, cos_i, outgoing, normal);
+
+	float correction = abs_dot(incident, normal);
+	if (almost_zero(correction)) return Color();
+	return Color(1.0f / correction);
+}
+
+static std::atomic<uint32_t> thread_count = 0;
+
+void set_thread_count(uint32_t count) { thread_count = count; }
+
+uint32_t get_thread_count()
+{
+	uint32_t count = thread_count;
+	if (count == 0) count = std::thread::hardware_concurrency();
+	return std::max(count, 1U);
+}
+
+static std::atomic<uint32_t> grain_size = 1;
+
+void set_grain_size(uint32_t size) { grain_size = std::max(size, 1U); }
+
+uint32_t get_grain_size() { return grain_size; }
+
+Arena::~Arena()
+{
+	for (Block& block : blocks) free_large(block.data, block.size);
+}
+
+void* Arena::allocate(size_t bytes, size_t alignment)
+{
+	//Blocks kept from before a reset are reused in order, skipping those too small for this allocation
+	for (; current < blocks.size(); ++current, offset = 0)
+	{
+		const Block& block = blocks[current];
+		size_t begin = (offset + alignment - 1) & ~(alignment - 1);
+		if (begin + bytes > block.size) continue;
+
+		offset = begin + bytes;
+		return block.data + begin;
+	}
+
+	size_t size = std::max(bytes, ArenaBlockSize);
+	blocks.push_back({ static_cast<std::byte*>(allocate_large(size)), size });
+	current = blocks.size() - 1;
+	offset = bytes;
+	return blocks.back().data;
+}
+
+size_t Arena::get_capacity() const
+{
+	size_t capacity = 0;
+	for (const Block& block : blocks) capacity += block.size;
+	return capacity;
+}
+
+thread_local Arena* thread_arena = nullptr;
+
+//The arenas of finished parallel_for workers, handed to the workers of the next calls
+static std::mutex arena_mutex;
+static std::vector<std::unique_ptr<Arena>> free_arenas;
+
+Arena& get_thread_arena()
+{
+	if (thread_arena == nullptr)
+	{
+		thread_local Arena arena;
+		thread_arena = &arena;
+	}
+
+	return *thread_arena;
+}
+
+static std::unique_ptr<Arena> acquire_arena()
+{
+	std::lock_guard lock(arena_mutex);
+	if (free_arenas.empty()) return std::make_unique<Arena>();
+
+	std::unique_ptr<Arena> arena = std::move(free_arenas.back());
+	free_arenas.pop_back();
+	return arena;
+}
+
+static void release_arena(std::unique_ptr<Arena> arena)
+{
+	arena->reset();
+	std::lock_guard lock(arena_mutex);
+	free_arenas.push_back(std::move(arena));
+}
+
 void parallel_for(uint32_t begin, uint32_t end, const std::function<void(uint32_t)>& action)
 {
 	if (end == begin) return;
 	if (end < begin) std::swap(begin, end);
 
-	uint32_t workers = std::thread::hardware_concurrency();
-	workers = std::min(std::max(workers, 1U), end - begin);
+	uint32_t grain = get_grain_size();
+	uint32_t workers = std::min(get_thread_count(), (end - begin + grain - 1) / grain);
+
+	//Every worker of every call receives a different seed, so consecutive
+	//calls (e.g. progressive passes) do not repeat the same random sequences
+	static std::atomic<uint32_t> next_seed = 0;
+	uint32_t seed = next_seed.fetch_add(workers);
 
 	std::vector<std::thread> threads;
 	std::atomic<uint32_t> current = begin;
 
+	//When tracing, workers wait for each other at the end so the load imbalance shows up as idle spans
+	bool tracing = is_tracing();
+	std::latch finished(workers);
+
 	for (uint32_t i = 0; i < workers; ++i)
 	{
-		auto entry = [i, end, &current, &action]()
+		auto entry = [i, seed, end, grain, tracing, &current, &finished, &action]()
 		{
-			make_random_engine(i);
+			make_random_engine(seed + i);
+			std::unique_ptr<Arena> arena = acquire_arena();
+			thread_arena = arena.get();
 
 			while (true)
 			{
-				uint32_t index = current++;
-				if (index >= end) break;
-				action(index);
+				uint32_t first = current.fetch_add(grain);
+				if (first >= end) break;
+				uint32_t last = std::min(first + grain, end);
+				for (uint32_t index = first; index < last; ++index) action(index);
 			}
+
+			thread_arena = nullptr;
+			release_arena(std::move(arena));
+
+			if (not tracing) return;
+			TraceSpan span("idle");
+			finished.arrive_and_wait();
 		};
 
 		threads.emplace_back(entry);
@@ -283,6 +865,54 @@ void parallel_for(uint32_t begin, uint32_t end, const std::function<void(uint32_
 	for (auto& thread : threads) thread.join();
 }
 
+std::vector<Region> split_tiles(const Region& region, uint32_t size)
+{
+	std::vector<Region> tiles;
+
+	for (uint32_t y = 0; y < region.height; y += size)
+	{
+		for (uint32_t x = 0; x < region.width; x += size)
+		{
+			uint32_t width = std::min(size, region.width - x);
+			uint32_t height = std::min(size, region.height - y);
+			tiles.push_back({ region.x + x, region.y + y, width, height });
+		}
+	}
+
+	return tiles;
+}
+
+std::vector<Color> Film::resolve(uint32_t stride, const Region& window) const
+{
+	std::vector<Color> colors(width * height);
+	stride = std::max(stride, 1U);
+
+	//The first sampled pixel of the window, rounded the same way as the preview passes
+	uint32_t first_x = (window.x + stride - 1) / stride * stride;
+	uint32_t first_y = (window.y + stride - 1) / stride * stride;
+	bool clamped = window.width > 0 && window.height > 0;
+
+	for (uint32_t y = 0; y < height; ++y)
+	{
+		for (uint32_t x = 0; x < width; ++x)
+		{
+			uint32_t source_x = x - x % stride;
+			uint32_t source_y = y - y % stride;
+
+			if (clamped && window.overlaps({ x, y, 1, 1 }))
+			{
+				source_x = std::max(source_x, first_x);
+				source_y = std::max(source_y, first_y);
+				if (source_x >= window.x + window.width || source_y >= window.y + window.height) continue;
+			}
+
+			colors[y * width + x] = get_color(source_x, source_y);
+		}
+	}
+
+	return colors;
+}
+
 void write_image(const std::string& filename, uint32_t width, uint32_t height, const Color* colors)
 {
 	std::vector<uint8_t> data;
@@ -311,3 +941,137 @@ void write_image(const std::string& filename, uint32_t width, uint32_t height, c
 	int result = stbi_write_png(filename.c_str(), casted_width, casted_height, 3, data.data(), 0);
 	if (result == 0) throw std::runtime_error("Error in when outputting image.");
 }
+
+void write_heatmap(const std::string& filename, uint32_t width, uint32_t height, const float* values)
+{
+	size_t count = static_cast<size_t>(width) * height;
+	if (count == 0) return;
+
+	//Sparse values such as rare events would otherwise have a percentile of zero
+	std::vector<float> sorted;
+	std::copy_if(values, values + count, std::back_inserter(sorted), [](float value) { return value > 0.0f; });
+	float scale = 0.0f;
+
+	if (not sorted.empty())
+	{
+		auto percentile = sorted.begin() + (sorted.size() - 1) * 99 / 100;
+		std::nth_element(sorted.begin(), percentile, sorted.end());
+		scale = 1.0f / *percentile;
+	}
+
+	const Color ramp[] = { { 0.0f, 0.0f, 0.5f }, { 0.0f, 0.5f, 1.0f }, { 0.0f, 1.0f, 0.0f }, { 1.0f, 1.0f, 0.0f }, { 1.0f, 0.0f, 0.0f } };
+	constexpr float Last = static_cast<float>(std::size(ramp) - 1);
+	std::vector<Color> colors(width * height);
+
+	for (size_t i = 0; i < colors.size(); ++i)
+	{
+		float position = std::clamp(values[i] * scale, 0.0f, 1.0f) * Last;
+		auto index = static_cast<size_t>(std::min(position, Last - 1.0f));
+		float weight = position - static_cast<float>(index);
+		Color color = ramp[index] * (1.0f - weight) + ramp[index + 1] * weight;
+
+		//Undoes the gamma correction of write_image
+		colors[i] = color * color;
+	}
+
+	write_image(filename, width, height, colors.data());
+}
+
+void write_float_image(const std::string& filename, uint32_t width, uint32_t height, const Color* colors)
+{
+	static_assert(sizeof(Color) == sizeof(float) * 3);
+
+	//A negative scale marks the data as little endian, rows are stored bottom to top like colors
+	std::ofstream stream(filename, std::ios::binary);
+	stream << "PF\n" << width << ' ' << height << "\n-1.0\n";
+	stream.write(reinterpret_cast<const char*>(colors), static_cast<std::streamsize>(sizeof(Color)) * width * height);
+	if (not stream) throw std::runtime_error("Error in when outputting float image.");
+}
+
+std::vector<Color> read_float_image(const std::string& filename, uint32_t& width, uint32_t& height)
+{
+	std::ifstream stream(filename, std::ios::binary);
+	std::string magic;
+	float scale;
+
+	stream >> magic >> width >> height >> scale;
+	stream.get(); //Single whitespace before the data
+	if (not stream || magic != "PF" || scale >= 0.0f) throw std::runtime_error("Unsupported float image: " + filename);
+
+	std::vector<Color> colors(width * height);
+	stream.read(reinterpret_cast<char*>(colors.data()), static_cast<std::streamsize>(sizeof(Color)) * width * height);
+	if (not stream) throw std::runtime_error("Error in when reading float image.");
+	return colors;
+}
+
+ImageError compare_images(uint32_t width, uint32_t height, const Color* colors, const Color* reference)
+{
+	constexpr uint32_t Block = 8;
+	constexpr double C1 = 0.01 * 0.01;
+	constexpr double C2 = 0.03 * 0.03;
+
+	uint32_t rows = (height + Block - 1) / Block;
+	std::vector<ImageError> partials(rows);
+
+	//Every block row is summed separately so that the workers never share an accumulator
+	parallel_for(0, rows, [&](uint32_t row)
+	{
+		ImageError& partial = partials[row];
+		uint32_t y_begin = row * Block;
+		uint32_t y_end = std::min(y_begin + Block, height);
+
+		for (uint32_t x_begin = 0; x_begin < width; x_begin += Block)
+		{
+			uint32_t x_end = std::min(x_begin + Block, width);
+			double sum = 0.0, sum2 = 0.0, sum_reference = 0.0, sum_reference2 = 0.0, sum_product = 0.0;
+
+			for (uint32_t y = y_begin; y < y_end; ++y)
+			{
+				for (uint32_t x = x_begin; x < x_end; ++x)
+				{
+					Color color = colors[y * width + x];
+					Color expected = reference[y * width + x];
+					Color difference = color - expected;
+					Color squared = difference * difference;
+
+					partial.mse += squared.x + squared.y + squared.z;
+					partial.relative_mse += dot(squared / (expected * expected + Vec3(0.01f)), Vec3(1.0f));
+
+					double luminance = get_luminance(color);
+					double luminance_reference = get_luminance(expected);
+					sum += luminance;
+					sum2 += luminance * luminance;
+					sum_reference += luminance_reference;
+					sum_reference2 += luminance_reference * luminance_reference;
+					sum_product += luminance * luminance_reference;
+				}
+			}
+
+			double count = (x_end - x_begin) * (y_end - y_begin);
+			double mean = sum / count;
+			double mean_reference = sum_reference / count;
+			double variance = sum2 / count - mean * mean;
+			double variance_reference = sum_reference2 / count - mean_reference * mean_reference;
+			double covariance = sum_product / count - mean * mean_reference;
+
+			partial.ssim += (2.0 * mean * mean_reference + C1) * (2.0 * covariance + C2) /
+			                ((mean * mean + mean_reference * mean_reference + C1) * (variance + variance_reference + C2));
+		}
+	});
+
+	ImageError result;
+
+	for (const ImageError& partial : partials)
+	{
+		result.mse += partial.mse;
+		result.relative_mse += partial.relative_mse;
+		result.ssim += partial.ssim;
+	}
+
+	double channels = 3.0 * width * height;
+	double blocks = static_cast<double>(rows) * ((width + Block - 1) / Block);
+	result.mse /= channels;
+	result.relative_mse /= channels;
+	result.ssim /= blocks;
+	return result;
+}
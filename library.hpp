@@ -1,14 +1,23 @@
 #pragma once
 
 #include "stb_image_write.h"
+#include "profile.hpp"
 
+#include <bit>
 #include <cmath>
+#include <deque>
+#include <algorithm>
+#include <mutex>
 #include <tuple>
 #include <string>
 #include <vector>
 #include <numbers>
+#include <new>
+#include <memory>
 #include <cstdint>
+#include <optional>
 #include <functional>
+#include <condition_variable>
 
 constexpr float Infinity = std::numeric_limits<float>::infinity();
 constexpr float Pi = std::numbers::pi_v<float>;
@@ -29,38 +38,579 @@ struct Ray
 	Vec3 origin, direction;
 };
 
+/**
+ * Finds the distance along a ray to a sphere.
+ * @return The distance, or Infinity if the sphere was missed. If intersected, also outputs the surface normal.
+ */
+float intersect_sphere(const Ray& ray, Vec3 center, float radius, Vec3& normal);
+
+/**
+ * Finds the distance along a ray to a plane, defined by the points p where dot(p, normal) + offset is zero.
+ * @return The distance, or Infinity if the plane was missed.
+ */
+float intersect_plane(const Ray& ray, Vec3 normal, float offset);
+
+/**
+ * Finds the distance along a ray to an axis aligned box.
+ * @return The distance, or Infinity if the box was missed. If intersected, also outputs the surface normal.
+ */
+float intersect_box(const Ray& ray, Vec3 min, Vec3 max, Vec3& normal);
+
+constexpr uint32_t ParticleLeafSize = 8;
+
+/**
+ * Up to ParticleLeafSize small spheres of one group, 84 bytes. The centers are 16 bit multiples of a step from the origin of the leaf
+ * and the radii 8 bit multiples of another step, stored by axis so that all particles of a leaf are intersected at once.
+ */
+struct ParticleLeaf
+{
+	Vec3 origin;
+	float step = 0.0f;
+	float radius_step = 0.0f;
+	uint32_t material = 0;
+	uint32_t count = 0;
+	uint16_t positions[3][ParticleLeafSize] = {};
+	uint8_t radii[ParticleLeafSize] = {}; //Zero for the unused slots
+};
+
+/**
+ * Finds the distance along a ray to the closest particle of a leaf, testing all of them at once with SIMD instructions where available.
+ * @param limit Particles at this distance or further are ignored.
+ * @return The distance, or Infinity if no particle was hit before the limit. If intersected, also outputs the surface normal.
+ */
+float intersect_particles(const Ray& ray, const ParticleLeaf& leaf, float limit, Vec3& normal);
+
+/**
+ * Finds the axis aligned bounding box of the decoded particles of a leaf.
+ */
+void get_particle_bounds(const ParticleLeaf& leaf, Vec3& min, Vec3& max);
+
+enum class PrimitiveKind : uint32_t
+{
+	Sphere,
+	Plane,
+	Box,
+	Particles //A ParticleLeaf
+};
+
+/**
+ * Identifies a primitive inside of a Scene.
+ * The top two bits store the PrimitiveKind and the rest stores the index among primitives of that kind.
+ */
+using PrimitiveID = uint32_t;
+
+inline PrimitiveID make_primitive_id(PrimitiveKind kind, size_t index) { return static_cast<uint32_t>(kind) << 30 | static_cast<uint32_t>(index); }
+inline PrimitiveKind get_primitive_kind(PrimitiveID id) { return static_cast<PrimitiveKind>(id >> 30); }
+inline uint32_t get_primitive_index(PrimitiveID id) { return id & 0x3FFFFFFFu; }
+
+enum class BVHLayout : uint32_t
+{
+	None,       //No hierarchy, every primitive is tested
+	Binary,     //Two children per node with full precision bounds
+	Compressed  //Four children per node with bounds quantized to 8 bits relative to the node
+};
+
+struct BVHSettings
+{
+	BVHLayout layout = BVHLayout::Binary;
+
+	//Enables spatial splits, which clip references to the split plane and reference them on both sides,
+	//as the fraction of extra references they may add. Large overlapping primitives then end up in tighter nodes.
+	float split_budget = 0.0f;
+
+	//Reorders the binary nodes into page sized treelets of the nodes most likely to be visited together
+	bool treelets = false;
+
+	//Only builds the top levels up front, down to subtrees of at most this many primitives, and every subtree
+	//the first time a ray enters it, so geometry no ray reaches is never built. Zero builds everything up front.
+	uint32_t lazy_size = 0;
+};
+
+constexpr size_t CacheLineSize = 64;
+constexpr size_t PageSize = 4096;
+constexpr size_t HugePageSize = 2 << 20;
+
+//Allocations from this size on are mapped directly in whole huge pages unless huge pages are off, smaller ones come from the heap
+constexpr size_t LargeAllocationSize = HugePageSize / 2;
+
+enum class HugePages : uint32_t
+{
+	Off,         //Regular pages from the heap only (the default)
+	Transparent, //Asks the kernel to back large allocations with transparent huge pages
+	Explicit     //Maps large allocations from the reserved huge page pool, falling back to transparent huge pages when it is empty
+};
+
+/**
+ * Sets how allocate_large backs large allocations, which only affects later allocations.
+ */
+void set_huge_pages(HugePages mode);
+
+HugePages get_huge_pages();
+
+/**
+ * Returns the bytes of the process currently backed by huge pages, as reported by the kernel, or zero where unknown.
+ */
+size_t get_huge_page_bytes();
+
+/**
+ * Allocates memory aligned to a cache line, or to a page for allocations of at least PageSize. Unless huge pages are off, allocations of at least LargeAllocationSize are
+ * aligned to and rounded up to whole huge pages, which cuts the TLB misses of randomly accessing large arrays.
+ * @param bytes Must be passed again to free_large.
+ */
+void* allocate_large(size_t bytes);
+
+void free_large(void* pointer, size_t bytes);
+
+/**
+ * Allocates through allocate_large, for the large long lived arrays of scenes, acceleration structures and films.
+ */
+template<class T>
+struct LargeAllocator
+{
+	using value_type = T;
+
+	LargeAllocator() = default;
+	template<class U> LargeAllocator(const LargeAllocator<U>&) {}
+
+	T* allocate(size_t count) { return static_cast<T*>(allocate_large(count * sizeof(T))); }
+	void deallocate(T* pointer, size_t count) { free_large(pointer, count * sizeof(T)); }
+
+	template<class U> bool operator==(const LargeAllocator<U>&) const { return true; }
+};
+
+template<class T>
+using LargeVector = std::vector<T, LargeAllocator<T>>;
+
+/**
+ * A node of a binary BVH, 32 bytes. The two children of an inner node are adjacent and start at an even index,
+ * so with the root followed by an unused node every pair of siblings fills exactly one cache line.
+ */
+struct BVHNode
+{
+	Vec3 min;
+	uint32_t index = 0; //The first child of an inner node, or the first reference of a leaf
+	Vec3 max;
+	uint32_t count = 0; //The number of references of a leaf, or zero for an inner node
+};
+
+/**
+ * A node of a compressed BVH with up to four children, 52 bytes.
+ * The bounds of every child are 8 bit multiples of a power of two step per axis, offset from the origin of the node
+ * and rounded outwards so they are conservative. Inner children are adjacent starting at child_base and the references
+ * of leaf children are adjacent starting at reference_base, so a single byte of meta data per child locates it.
+ */
+struct CompressedNode
+{
+	Vec3 origin;
+	int8_t exponents[3] = {};
+	uint8_t inner_mask = 0; //Bit i is set if child i is an inner node
+	uint32_t child_base = 0;
+	uint32_t reference_base = 0;
+	uint8_t meta[4] = {};   //For leaf children the offset from reference_base << 3 | count, zero for empty slots
+	uint8_t lower[3][4] = {};
+	uint8_t upper[3][4] = {};
+};
+
+/**
+ * Returns the step of the quantized bounds of a CompressedNode, two to the power of an exponent.
+ */
+inline float get_quantization_step(int8_t exponent) { return std::bit_cast<float>(static_cast<uint32_t>(exponent + 127) << 23); }
+
+/**
+ * A bounding volume hierarchy over references to primitives, built from their bounds.
+ */
+class BVH
+{
+public:
+	/**
+	 * Builds the hierarchy with binned surface area heuristic splits.
+	 * @param primitives The referenced primitives, with their bounds in mins and maxs.
+	 */
+	void build(const std::vector<PrimitiveID>& primitives, const std::vector<Vec3>& mins, const std::vector<Vec3>& maxs, const BVHSettings& settings);
+
+	void clear();
+
+	bool empty() const { return layout == BVHLayout::None; }
+	BVHLayout get_layout() const { return layout; }
+
+	/**
+	 * Returns the number of nodes and references, which for a lazy hierarchy includes the subtrees built so far.
+	 */
+	size_t get_node_count() const;
+	size_t get_reference_count() const;
+
+	/**
+	 * Returns the memory held by the nodes and references, in bytes.
+	 * For a lazy hierarchy this includes the subtrees built so far and the bounds kept to build the others.
+	 */
+	size_t get_bytes() const;
+
+	/**
+	 * Returns the expected cost of a ray that hits the root, in units of primitive tests, by the surface area heuristic.
+	 * For a lazy hierarchy only the top levels are counted, with every subtree as a single test.
+	 */
+	double get_sah_cost() const { return sah_cost; }
+
+	/**
+	 * Returns the number of subtrees of a lazy hierarchy (see BVHSettings::lazy_size), and how many of them rays entered and built.
+	 */
+	size_t get_subtree_count() const { return subtrees.size(); }
+	size_t get_built_subtree_count() const;
+
+	/**
+	 * Visits the references of every leaf a ray enters before a distance.
+	 * @param intersect Called with every PrimitiveID, and lowers the distance when it finds a closer intersection.
+	 */
+	template<class Intersect>
+	void traverse(const Ray& ray, float& distance, Intersect intersect) const;
+
+private:
+	friend class SharedScene;
+
+	//These only read the arrays they are given, so they also traverse the copies in shared memory
+	template<class Intersect>
+	static void traverse_binary(const BVHNode* nodes, const PrimitiveID* references, const Ray& ray, float& distance, Intersect& intersect);
+
+	template<class Intersect>
+	static void traverse_compressed(const CompressedNode* nodes, const PrimitiveID* references, const Ray& ray, float& distance, Intersect& intersect);
+
+	template<class Intersect>
+	void traverse_lazy(const Ray& ray, float& distance, Intersect& intersect) const;
+
+	struct Subtree;
+
+	void build_lazy(const std::vector<PrimitiveID>& primitives, const std::vector<Vec3>& mins, const std::vector<Vec3>& maxs, const BVHSettings& settings);
+	void build_subtree(Subtree& subtree) const;
+	void reorder_treelets();
+	void compress();
+
+	BVHLayout layout = BVHLayout::None;
+	LargeVector<BVHNode> nodes;
+	LargeVector<CompressedNode> compressed_nodes;
+	LargeVector<PrimitiveID> references; //The indices of the subtrees for a lazy hierarchy
+	double sah_cost = 0.0;
+
+	std::vector<std::unique_ptr<Subtree>> subtrees;
+	BVHSettings subtree_settings;
+};
+
+/**
+ * A part of a lazy BVH, which keeps the bounds of its primitives until a ray first enters it and builds it.
+ */
+struct BVH::Subtree
+{
+	std::once_flag once;
+	std::atomic<bool> built = false;
+	size_t count = 0; //The number of primitives, which stays when their bounds are released
+	std::vector<PrimitiveID> primitives;
+	std::vector<Vec3> mins;
+	std::vector<Vec3> maxs;
+	BVH bvh;
+};
+
 class Scene
 {
 public:
 	Scene() = default;
 
-	void insert_sphere(Vec3 center, float radius, uint32_t material = 0)
+	PrimitiveID insert_sphere(Vec3 center, float radius, uint32_t material = 0)
 	{
+		bvh.clear();
 		spheres.emplace_back(center, radius, material);
+		return make_primitive_id(PrimitiveKind::Sphere, spheres.size() - 1);
 	}
 
-	void insert_plane(Vec3 normal, float offset, uint32_t material = 0)
+	PrimitiveID insert_plane(Vec3 normal, float offset, uint32_t material = 0)
 	{
 		planes.emplace_back(normal, offset, material);
+		return make_primitive_id(PrimitiveKind::Plane, planes.size() - 1);
 	}
 
-	void insert_box(Vec3 center, Vec3 size, uint32_t material = 0);
+	PrimitiveID insert_box(Vec3 center, Vec3 size, uint32_t material = 0);
+
+	/**
+	 * Inserts a group of particles, small spheres of one material that are stored compactly with quantized centers and radii.
+	 * The particles are split at the median of the longest axis into full leaves of ParticleLeafSize, which are the primitives.
+	 * @param radii The radius of every particle, or null if they all have the same radius.
+	 * @return The PrimitiveID of the first leaf of the group, whose other leaves follow it.
+	 */
+	PrimitiveID insert_particles(const Vec3* positions, const float* radii, size_t count, float radius, uint32_t material = 0);
+
+	/**
+	 * Inserts every group of particles of a particle file. The file is mapped rather than read into memory,
+	 * so only the quantized particles take memory. A file starts with the magic "PARTIC01" and the number of groups as 64 bits,
+	 * then every group is its number of particles as 64 bits, its radius and its material, followed by the centers of its particles
+	 * and, if its radius is zero, their radii.
+	 */
+	void read_particles(const std::string& filename);
+
+	/**
+	 * Writes the decoded particles into a particle file, see read_particles, with a group for every run of leaves with the same material.
+	 */
+	void write_particles(const std::string& filename) const;
+
+	/**
+	 * Reserves memory for more primitives, which avoids the peak memory of growing to large counts.
+	 */
+	void reserve(size_t sphere_count, size_t plane_count, size_t box_count)
+	{
+		spheres.reserve(spheres.size() + sphere_count);
+		planes.reserve(planes.size() + plane_count);
+		boxes.reserve(boxes.size() + box_count);
+	}
+
+	/**
+	 * Changes the material of an existing primitive.
+	 */
+	void set_material(PrimitiveID primitive, uint32_t material);
+
+	/**
+	 * Moves an existing primitive by an offset.
+	 */
+	void translate(PrimitiveID primitive, Vec3 offset);
+
+	/**
+	 * Finds the axis aligned bounding box of a primitive.
+	 * @return Whether the primitive is bounded (planes are not).
+	 */
+	bool get_bounds(PrimitiveID primitive, Vec3& min, Vec3& max) const;
+
+	/**
+	 * Returns a hash of every primitive, which changes whenever a primitive is inserted, moved or changes material.
+	 */
+	uint64_t get_hash() const;
+
+	/**
+	 * Returns the memory held by the primitives and the BVH, in bytes.
+	 */
+	size_t get_bytes() const;
+
+	/**
+	 * Builds a BVH over the spheres and boxes, which intersect then traverses instead of testing all of them.
+	 * Inserting or moving spheres or boxes discards it. Planes are unbounded and always tested.
+	 */
+	void build_bvh(const BVHSettings& settings = {});
+
+	const BVH& get_bvh() const { return bvh; }
 
 	/**
 	 * Finds whether a ray intersects with a scene.
 	 * @return Whether the intersection occurred.
 	 * If intersected, also outputs the travelled distance, and surface normal and material.
 	 */
+	bool intersect(const Ray& ray, float& distance, Vec3& normal, uint32_t& material) const
+	{
+		PrimitiveID primitive;
+		return intersect(ray, distance, normal, material, primitive);
+	}
+
+	/**
+	 * Finds whether a ray intersects with a scene.
+	 * If intersected, also outputs the PrimitiveID of the intersected primitive.
+	 */
+	bool intersect(const Ray& ray, float& distance, Vec3& normal, uint32_t& material, PrimitiveID& primitive) const;
+
+private:
+	friend class OutOfCoreScene;
+	friend class SharedScene;
+
+	LargeVector<std::tuple<Vec3, float, uint32_t>> spheres;
+	LargeVector<std::tuple<Vec3, float, uint32_t>> planes;
+	LargeVector<std::tuple<Vec3, Vec3, uint32_t>> boxes;
+	LargeVector<ParticleLeaf> particles;
+	BVH bvh;
+};
+
+/**
+ * The closest intersection of a ray, or a miss if the distance is Infinity.
+ */
+struct RayHit
+{
+	float distance = Infinity;
+	Vec3 normal;
+	uint32_t material = 0;
+};
+
+/**
+ * The layouts of primitives in chunk files and shared scenes, which have no padding.
+ */
+struct SphereRecord
+{
+	Vec3 center;
+	float radius;
+	uint32_t material;
+};
+
+struct PlaneRecord
+{
+	Vec3 normal;
+	float offset;
+	uint32_t material;
+};
+
+struct BoxRecord
+{
+	Vec3 min;
+	Vec3 max;
+	uint32_t material;
+};
+
+/**
+ * A scene whose spheres and boxes are stored in spatial chunks of a memory mapped file, of which only as many
+ * are resident at once as fit in a memory budget. Rays are intersected in batches: every ray is queued at the
+ * chunks it crosses, then the chunks are processed one after the other so that each is paged in at most once per batch.
+ */
+class OutOfCoreScene
+{
+public:
+	/**
+	 * Writes the spheres and boxes of a scene into a chunk file.
+	 * The primitives are split at the median of the longest axis of their centers until every chunk holds at most a number of them.
+	 */
+	static void write(const Scene& scene, const std::string& filename, uint32_t chunk_primitives);
+
+	/**
+	 * Maps a chunk file. Planes are unbounded and cannot be chunked, so they are copied from a scene instead and always resident.
+	 * @param budget The bytes of resident chunks past which the least recently used ones are evicted.
+	 * A chunk is always paged in, even if it alone is larger than the budget.
+	 */
+	OutOfCoreScene(const std::string& filename, const Scene& planes, size_t budget, const BVHSettings& settings = {});
+	~OutOfCoreScene();
+
+	OutOfCoreScene(const OutOfCoreScene&) = delete;
+	OutOfCoreScene& operator=(const OutOfCoreScene&) = delete;
+
+	/**
+	 * Finds the closest intersection of every ray of a batch. Each chunk is intersected in parallel, so this must only be called by one thread at a time.
+	 */
+	void intersect(const Ray* rays, size_t count, RayHit* hits);
+
+	size_t get_chunk_count() const { return chunks.size(); }
+	size_t get_peak_resident_bytes() const { return peak_resident_bytes; }
+	uint64_t get_page_ins() const { return page_ins; }
+
+private:
+	struct Chunk
+	{
+		Vec3 min;
+		Vec3 max;
+		size_t offset = 0; //Of the primitives in the file
+		uint32_t sphere_count = 0;
+		uint32_t box_count = 0;
+
+		std::unique_ptr<Scene> scene; //Null while not resident
+		size_t resident_bytes = 0;
+		uint64_t last_batch = 0;
+
+		//The rays of the current batch crossing the chunk, with the distance where they enter it
+		std::vector<std::pair<uint32_t, float>> queue;
+	};
+
+	void page_in(Chunk& chunk);
+	void evict(Chunk& chunk);
+
+	int file = -1;
+	std::byte* mapping = nullptr;
+	size_t mapping_size = 0;
+
+	Scene planes;
+	std::vector<Chunk> chunks;
+	BVH chunk_bvh; //Over the bounds of the chunks, whose indices are used as primitives
+	BVHSettings settings;
+	std::vector<uint32_t> order;
+
+	size_t budget;
+	size_t resident_bytes = 0;
+	size_t peak_resident_bytes = 0;
+	uint64_t page_ins = 0;
+	uint64_t batch = 0;
+};
+
+/**
+ * A scene and its BVH in a named POSIX shared memory segment, which every render process on a host maps read only
+ * instead of holding its own copy. The segment only holds offsets from its start, so it can be mapped at any address.
+ */
+class SharedScene
+{
+public:
+	/**
+	 * Copies a scene and its BVH into a new segment, which stays until it is removed, even after every process exits.
+	 * @param name The name of the segment, such as "/scene". Fails if a segment with this name already exists.
+	 */
+	static void create(const Scene& scene, const std::string& name);
+
+	/**
+	 * Removes the name of a segment. Processes that attached to it keep their mapping until they detach.
+	 */
+	static void remove(const std::string& name);
+
+	/**
+	 * Attaches to an existing segment. Fails unless the segment is complete and every node, reference and leaf
+	 * of particles stays within it, which reads the whole hierarchy once.
+	 */
+	explicit SharedScene(const std::string& name);
+	~SharedScene();
+
+	SharedScene(const SharedScene&) = delete;
+	SharedScene& operator=(const SharedScene&) = delete;
+
+	/**
+	 * Finds whether a ray intersects with the scene, see Scene::intersect.
+	 */
 	bool intersect(const Ray& ray, float& distance, Vec3& normal, uint32_t& material) const;
 
+	size_t get_bytes() const { return mapping_size; }
+
 private:
-	std::vector<std::tuple<Vec3, float, uint32_t>> spheres;
-	std::vector<std::tuple<Vec3, float, uint32_t>> planes;
-	std::vector<std::tuple<Vec3, Vec3, uint32_t>> boxes;
+	const std::byte* mapping = nullptr;
+	size_t mapping_size = 0;
+
+	BVHLayout layout = BVHLayout::None;
+	const SphereRecord* spheres = nullptr;
+	const PlaneRecord* planes = nullptr;
+	const BoxRecord* boxes = nullptr;
+	const ParticleLeaf* particles = nullptr;
+	const void* nodes = nullptr; //Either BVHNode or CompressedNode depending on the layout
+	const PrimitiveID* references = nullptr;
+	size_t sphere_count = 0;
+	size_t plane_count = 0;
+	size_t box_count = 0;
+	size_t particle_count = 0;
 };
 
 using Color = Vec3;
 
+enum class ProceduralKind : uint32_t
+{
+	Spheres,  //Randomly placed spheres
+	Boxes,    //Randomly placed boxes
+	Grid,     //A dense regular grid alternating spheres and boxes
+	Stack,    //Deep stacks of thin overlapping slabs
+	Emitters, //Randomly placed spheres of which a quarter are emitters
+	Particles //Randomly placed particles in a group per material
+};
+
+struct ProceduralSettings
+{
+	ProceduralKind kind = ProceduralKind::Spheres;
+	uint32_t count = 1000;
+	uint32_t seed = 0;
+
+	//The volume the primitives are placed in
+	Vec3 min = Vec3(-5.0f, 0.0f, -5.0f);
+	Vec3 max = Vec3(5.0f, 10.0f, 5.0f);
+
+	//Every primitive randomly receives one of these
+	std::vector<uint32_t> materials = { 0 };
+	std::vector<uint32_t> emitters = { 0 };
+};
+
+/**
+ * Inserts generated primitives into a scene. The result only depends on the settings, so a seed
+ * always reproduces the same scene. Primitives are scaled down as their count grows, keeping the density similar.
+ */
+void insert_procedural(Scene& scene, const ProceduralSettings& settings);
+
 inline Vec3 operator+(Vec3 value, Vec3 other) { return { value.x + other.x, value.y + other.y, value.z + other.z }; }
 inline Vec3 operator-(Vec3 value, Vec3 other) { return { value.x - other.x, value.y - other.y, value.z - other.z }; }
 inline Vec3 operator*(Vec3 value, Vec3 other) { return { value.x * other.x, value.y * other.y, value.z * other.z }; }
@@ -115,6 +665,11 @@ inline Vec3 cross(Vec3 value, Vec3 other)
  */
 float random_float();
 
+/**
+ * Restarts the random sequence of the calling thread from a seed, which makes the values that follow reproducible.
+ */
+void seed_random(uint32_t seed);
+
 /**
  * @return A random point in the volume of a unit sphere.
  */
@@ -152,6 +707,82 @@ inline Ray bounce(const Ray& ray, float distance, Vec3 direction)
 	return { point, direction };
 }
 
+/**
+ * Encodes a unit vector in 32 bits by projecting it onto an octahedron unfolded into a square,
+ * whose two coordinates are stored as 16 bit fixed point values. The angular error is below 1E-4 radians.
+ */
+inline uint32_t encode_octahedral(Vec3 direction)
+{
+	float sum = std::abs(direction.x) + std::abs(direction.y) + std::abs(direction.z);
+	if (not (sum > 0.0f)) return 0;
+
+	float u = direction.x * (1.0f / sum);
+	float v = direction.y * (1.0f / sum);
+
+	if (direction.z < 0.0f)
+	{
+		float folded = (1.0f - std::abs(v)) * std::copysign(1.0f, u);
+		v = (1.0f - std::abs(u)) * std::copysign(1.0f, v);
+		u = folded;
+	}
+
+	auto quantize = [](float value) { return static_cast<uint32_t>((std::clamp(value, -1.0f, 1.0f) * 0.5f + 0.5f) * 65535.0f + 0.5f); };
+	return quantize(u) | quantize(v) << 16;
+}
+
+inline Vec3 decode_octahedral(uint32_t value)
+{
+	float u = static_cast<float>(value & 0xFFFF) / 65535.0f * 2.0f - 1.0f;
+	float v = static_cast<float>(value >> 16) / 65535.0f * 2.0f - 1.0f;
+	Vec3 result(u, v, 1.0f - std::abs(u) - std::abs(v));
+
+	if (result.z < 0.0f)
+	{
+		result.x = (1.0f - std::abs(v)) * std::copysign(1.0f, u);
+		result.y = (1.0f - std::abs(u)) * std::copysign(1.0f, v);
+	}
+
+	return normalize(result);
+}
+
+/**
+ * Converts a value to a half precision (16 bit) float, rounding to the nearest value.
+ * Infinities and NaN are kept, values too large become infinite and values below 2^-24 become zero.
+ */
+inline uint16_t encode_half(float value)
+{
+	uint32_t bits = std::bit_cast<uint32_t>(value);
+	uint32_t sign = bits >> 16 & 0x8000;
+	uint32_t magnitude = bits & 0x7FFFFFFF;
+
+	if (magnitude > 0x7F800000) return static_cast<uint16_t>(sign | 0x7E00);
+	if (magnitude >= 0x477FF000) return static_cast<uint16_t>(sign | 0x7C00);
+	if (magnitude <= 0x33000000) return static_cast<uint16_t>(sign);
+
+	if (magnitude < 0x38800000)
+	{
+		//Below the smallest normal value, the mantissa with its implicit bit is shifted into a subnormal value
+		uint32_t mantissa = (magnitude & 0x7FFFFF) | 0x800000;
+		uint32_t shift = 126 - (magnitude >> 23);
+		uint32_t subnormal = (mantissa + (1U << (shift - 1)) - 1 + (mantissa >> shift & 1)) >> shift;
+		return static_cast<uint16_t>(sign | subnormal);
+	}
+
+	//Moves the exponent bias from 127 to 15 and rounds the mantissa to nearest even
+	uint32_t rounded = magnitude - 0x38000000 + 0xFFF + (magnitude >> 13 & 1);
+	return static_cast<uint16_t>(sign | rounded >> 13);
+}
+
+inline float decode_half(uint16_t value)
+{
+	uint32_t sign = static_cast<uint32_t>(value & 0x8000) << 16;
+	uint32_t magnitude = value & 0x7FFF;
+
+	if (magnitude < 0x400) return std::bit_cast<float>(sign | std::bit_cast<uint32_t>(static_cast<float>(magnitude) * 0x1P-24f));
+	if (magnitude >= 0x7C00) return std::bit_cast<float>(sign | 0x7F800000 | (magnitude & 0x3FF) << 13);
+	return std::bit_cast<float>(sign | ((magnitude << 13) + 0x38000000));
+}
+
 /**
  * Flips incident to be on the same side of a surface as outgoing.
  * @param normal The normal vector that describes the surface.
@@ -202,12 +833,182 @@ float fresnel_value(float eta, float cos_o, float cos_i);
  */
 Vec3 fresnel_refract(float eta, float cos_i, Vec3 outgoing, Vec3 normal);
 
+/**
+ * Samples a perfectly diffuse reflection.
+ * @param outgoing The direction towards where the light leaves.
+ * @param normal The normal of the surface.
+ * @param incident Outputs the sampled direction towards where the light arrives.
+ * @return The evaluated value divided by the probability density of the sample.
+ */
+Color bsdf_lambertian_reflection(Vec3 outgoing, Vec3 normal, Vec3& incident);
+
+/**
+ * Samples a perfect mirror reflection.
+ * @see bsdf_lambertian_reflection
+ */
+Color bsdf_specular_reflection(Vec3 outgoing, Vec3 normal, Vec3& incident);
+
+/**
+ * Samples either the reflection or the refraction of a smooth dielectric, based on the fresnel value.
+ * @param eta The index of refraction of the fresnel.
+ * @see bsdf_lambertian_reflection
+ */
+Color bsdf_specular_fresnel(Vec3 outgoing, Vec3 normal, Vec3& incident, float eta);
+
 /**
  * Returns the luminance value of a color.
  * This can be thought of as the visually perceived brightness.
  */
 inline float get_luminance(Color color) { return dot(color, { 0.212671f, 0.715160f, 0.072169f }); }
 
+/**
+ * Finds the distance along a ray to an axis aligned box, for a ray given by its origin and inverse direction.
+ * @return The distance the ray enters the box at (zero if it starts inside), or Infinity if it misses the box before a limit.
+ */
+inline float intersect_bounds(Vec3 origin, Vec3 inverse_direction, Vec3 min, Vec3 max, float limit)
+{
+	Vec3 lengths_min = (min - origin) * inverse_direction;
+	Vec3 lengths_max = (max - origin) * inverse_direction;
+
+	float near_x = std::min(lengths_min.x, lengths_max.x);
+	float near_y = std::min(lengths_min.y, lengths_max.y);
+	float near_z = std::min(lengths_min.z, lengths_max.z);
+	float far_x = std::max(lengths_min.x, lengths_max.x);
+	float far_y = std::max(lengths_min.y, lengths_max.y);
+	float far_z = std::max(lengths_min.z, lengths_max.z);
+
+	float near = std::max(std::max(0.0f, near_x), std::max(near_y, near_z));
+	float far = std::min(std::min(limit, far_x), std::min(far_y, far_z));
+	return near <= far ? near : Infinity;
+}
+
+template<class Intersect>
+void BVH::traverse(const Ray& ray, float& distance, Intersect intersect) const
+{
+	if (not subtrees.empty()) traverse_lazy(ray, distance, intersect);
+	else if (layout == BVHLayout::Binary) traverse_binary(nodes.data(), references.data(), ray, distance, intersect);
+	else if (layout == BVHLayout::Compressed) traverse_compressed(compressed_nodes.data(), references.data(), ray, distance, intersect);
+}
+
+template<class Intersect>
+void BVH::traverse_lazy(const Ray& ray, float& distance, Intersect& intersect) const
+{
+	//The top levels are a binary hierarchy over the bounds of the subtrees, whose leaves reference subtrees
+	auto enter = [&](PrimitiveID index)
+	{
+		Subtree& subtree = *subtrees[index];
+
+		//Checking the flag first skips the cost of call_once once the subtree is built, which is almost always
+		if (not subtree.built.load(std::memory_order_acquire)) std::call_once(subtree.once, [&] { build_subtree(subtree); });
+
+		const BVH& bvh = subtree.bvh;
+		if (bvh.layout == BVHLayout::Binary) traverse_binary(bvh.nodes.data(), bvh.references.data(), ray, distance, intersect);
+		else if (bvh.layout == BVHLayout::Compressed) traverse_compressed(bvh.compressed_nodes.data(), bvh.references.data(), ray, distance, intersect);
+	};
+
+	traverse_binary(nodes.data(), references.data(), ray, distance, enter);
+}
+
+template<class Intersect>
+void BVH::traverse_binary(const BVHNode* nodes, const PrimitiveID* references, const Ray& ray, float& distance, Intersect& intersect)
+{
+	//The builder limits the depth so the stack never overflows
+	constexpr size_t StackSize = 128;
+	uint32_t stack[StackSize];
+	size_t height = 0;
+
+	Vec3 inverse_direction = Vec3(1.0f) / ray.direction;
+	const BVHNode* root = nodes;
+	if (intersect_bounds(ray.origin, inverse_direction, root->min, root->max, distance) == Infinity) return;
+	uint32_t current = 0;
+
+	while (true)
+	{
+		const BVHNode& node = nodes[current];
+		STATISTIC(node_visits += 1);
+
+		if (node.count > 0)
+		{
+			for (uint32_t i = node.index; i < node.index + node.count; ++i) intersect(references[i]);
+		}
+		else
+		{
+			const BVHNode& left = nodes[node.index];
+			const BVHNode& right = nodes[node.index + 1];
+			float distance_left = intersect_bounds(ray.origin, inverse_direction, left.min, left.max, distance);
+			float distance_right = intersect_bounds(ray.origin, inverse_direction, right.min, right.max, distance);
+
+			if (distance_left != Infinity || distance_right != Infinity)
+			{
+				//Visits the nearer child first, which finds close intersections early and culls more
+				bool right_first = distance_right < distance_left;
+				if (distance_left != Infinity && distance_right != Infinity) stack[height++] = right_first ? node.index : node.index + 1;
+				current = right_first ? node.index + 1 : node.index;
+				continue;
+			}
+		}
+
+		//Skips the nodes that became further away than the closest intersection found since they were pushed
+		do
+		{
+			if (height == 0) return;
+			current = stack[--height];
+		}
+		while (intersect_bounds(ray.origin, inverse_direction, nodes[current].min, nodes[current].max, distance) == Infinity);
+	}
+}
+
+template<class Intersect>
+void BVH::traverse_compressed(const CompressedNode* nodes, const PrimitiveID* references, const Ray& ray, float& distance, Intersect& intersect)
+{
+	constexpr size_t StackSize = 128 * 3;
+	uint32_t stack[StackSize];
+	size_t height = 0;
+
+	Vec3 inverse_direction = Vec3(1.0f) / ray.direction;
+	stack[height++] = 0;
+
+	while (height > 0)
+	{
+		const CompressedNode& node = nodes[stack[--height]];
+		STATISTIC(node_visits += 1);
+
+		Vec3 step(get_quantization_step(node.exponents[0]), get_quantization_step(node.exponents[1]), get_quantization_step(node.exponents[2]));
+		std::pair<float, uint32_t> hits[4];
+		uint32_t hit_count = 0;
+		uint32_t inner_index = node.child_base;
+
+		for (uint32_t i = 0; i < 4; ++i)
+		{
+			bool inner = node.inner_mask >> i & 1;
+			if (not inner && node.meta[i] == 0) continue;
+
+			Vec3 lower(node.lower[0][i], node.lower[1][i], node.lower[2][i]);
+			Vec3 upper(node.upper[0][i], node.upper[1][i], node.upper[2][i]);
+			float near = intersect_bounds(ray.origin, inverse_direction, node.origin + lower * step, node.origin + upper * step, distance);
+
+			if (inner)
+			{
+				if (near != Infinity) hits[hit_count++] = { near, inner_index };
+				++inner_index;
+				continue;
+			}
+
+			if (near == Infinity) continue;
+			uint32_t first = node.reference_base + (node.meta[i] >> 3);
+			for (uint32_t j = first; j < first + (node.meta[i] & 7); ++j) intersect(references[j]);
+		}
+
+		//Pushes the inner children from far to near, so the nearest one is visited next
+		for (uint32_t i = 1; i < hit_count; ++i)
+		{
+			for (uint32_t j = i; j > 0 && hits[j - 1].first < hits[j].first; --j) std::swap(hits[j - 1], hits[j]);
+		}
+
+		for (uint32_t i = 0; i < hit_count; ++i) stack[height++] = hits[i].second;
+	}
+}
+
 /**
  * Returns whether a color is almost black.
  */
@@ -218,6 +1019,26 @@ inline bool almost_black(Color color) { return almost_zero(get_luminance(color))
  */
 inline bool is_invalid(Color color) { return not std::isfinite(color.x + color.y + color.z); }
 
+/**
+ * Sets the number of threads used by parallel_for.
+ * @param count The number of threads, or zero to use one thread per hardware thread (the default).
+ */
+void set_thread_count(uint32_t count);
+
+/**
+ * Returns the number of threads used by parallel_for.
+ */
+uint32_t get_thread_count();
+
+/**
+ * Sets the number of consecutive indices a thread of parallel_for takes at once.
+ * Larger grains lower the scheduling overhead of many small work items, at the cost of a worse load balance.
+ * @param size The number of indices, at least one (the default).
+ */
+void set_grain_size(uint32_t size);
+
+uint32_t get_grain_size();
+
 /**
  * Executes an action in parallel, taking advantage of multiple threads.
  * @param begin The first index to execute (inclusive).
@@ -226,7 +1047,277 @@ inline bool is_invalid(Color color) { return not std::isfinite(color.x + color.y
  */
 void parallel_for(uint32_t begin, uint32_t end, const std::function<void(uint32_t)>& action);
 
+constexpr size_t ArenaBlockSize = 256 << 10;
+
+/**
+ * The position of an Arena, to which it can be rewound.
+ */
+struct ArenaMark
+{
+	size_t block = 0;
+	size_t offset = 0;
+};
+
+/**
+ * Allocates short lived memory by bumping an offset through blocks, which are kept when the arena is reset
+ * so that steady state passes allocate nothing from the heap. Individual allocations are never freed.
+ * An arena must only be used by one thread at a time.
+ */
+class Arena
+{
+public:
+	Arena() = default;
+	~Arena();
+
+	Arena(const Arena&) = delete;
+	Arena& operator=(const Arena&) = delete;
+
+	/**
+	 * @param alignment Must be a power of two up to CacheLineSize.
+	 */
+	void* allocate(size_t bytes, size_t alignment);
+
+	ArenaMark get_mark() const { return { current, offset }; }
+
+	/**
+	 * Frees everything allocated since a mark was taken.
+	 */
+	void rewind(ArenaMark mark)
+	{
+		current = mark.block;
+		offset = mark.offset;
+	}
+
+	void reset() { rewind({}); }
+
+	/**
+	 * Returns the bytes of all the blocks held by the arena.
+	 */
+	size_t get_capacity() const;
+
+private:
+	struct Block
+	{
+		std::byte* data;
+		size_t size;
+	};
+
+	std::vector<Block> blocks;
+	size_t current = 0;
+	size_t offset = 0;
+};
+
+/**
+ * Returns the arena of the calling thread. Every parallel_for worker borrows a pooled arena, which is reset
+ * when the call ends and kept for the next call, so per pass memory does not depend on the threads being reused.
+ */
+Arena& get_thread_arena();
+
+/**
+ * Rewinds an arena to where it was at construction when destroyed, which frees the memory of a tile or a path.
+ */
+class ArenaScope
+{
+public:
+	explicit ArenaScope(Arena& arena) : arena(arena), mark(arena.get_mark()) {}
+	~ArenaScope() { arena.rewind(mark); }
+
+	ArenaScope(const ArenaScope&) = delete;
+	ArenaScope& operator=(const ArenaScope&) = delete;
+
+private:
+	Arena& arena;
+	ArenaMark mark;
+};
+
+/**
+ * Allocates from an Arena, by default the one of the constructing thread.
+ * Containers using it must be destroyed or cleared before their memory is rewound.
+ */
+template<class T>
+struct ArenaAllocator
+{
+	using value_type = T;
+
+	ArenaAllocator() : arena(&get_thread_arena()) {}
+	explicit ArenaAllocator(Arena& arena) : arena(&arena) {}
+	template<class U> ArenaAllocator(const ArenaAllocator<U>& other) : arena(other.arena) {}
+
+	T* allocate(size_t count) { return static_cast<T*>(arena->allocate(count * sizeof(T), alignof(T))); }
+	void deallocate(T*, size_t) {}
+
+	template<class U> bool operator==(const ArenaAllocator<U>& other) const { return arena == other.arena; }
+
+	Arena* arena;
+};
+
+template<class T>
+using ArenaVector = std::vector<T, ArenaAllocator<T>>;
+
+/**
+ * A thread safe first in first out queue holding at most a fixed number of values.
+ * Passes work between pipeline stages while bounding the memory held in flight.
+ */
+template<class T>
+class BoundedQueue
+{
+public:
+	explicit BoundedQueue(size_t capacity) : capacity(capacity) {}
+
+	/**
+	 * Inserts a value, waiting while the queue is full.
+	 * @return Whether the value was inserted, which fails if the queue is closed.
+	 */
+	bool push(T value)
+	{
+		std::unique_lock lock(mutex);
+		not_full.wait(lock, [this] { return closed || values.size() < capacity; });
+		if (closed) return false;
+
+		values.push_back(std::move(value));
+		not_empty.notify_one();
+		return true;
+	}
+
+	/**
+	 * Removes the oldest value, waiting while the queue is empty.
+	 * @return The value, or nothing if the queue is closed and empty.
+	 */
+	std::optional<T> pop()
+	{
+		std::unique_lock lock(mutex);
+		not_empty.wait(lock, [this] { return closed || not values.empty(); });
+		if (values.empty()) return std::nullopt;
+
+		T value = std::move(values.front());
+		values.pop_front();
+		not_full.notify_one();
+		return value;
+	}
+
+	/**
+	 * Stops accepting new values and wakes up all waiting threads.
+	 * Values already inserted can still be removed.
+	 */
+	void close()
+	{
+		std::lock_guard lock(mutex);
+		closed = true;
+		not_full.notify_all();
+		not_empty.notify_all();
+	}
+
+private:
+	size_t capacity;
+	bool closed = false;
+	std::deque<T> values;
+	std::mutex mutex;
+	std::condition_variable not_full;
+	std::condition_variable not_empty;
+};
+
+/**
+ * An axis aligned rectangle of pixels.
+ */
+struct Region
+{
+	uint32_t x = 0, y = 0;
+	uint32_t width = 0, height = 0;
+
+	bool overlaps(const Region& other) const
+	{
+		return x < other.x + other.width && other.x < x + width &&
+		       y < other.y + other.height && other.y < y + height;
+	}
+};
+
+/**
+ * Splits a region into square tiles in scanline order.
+ * Tiles on the far edges are clipped to fit inside the region.
+ */
+std::vector<Region> split_tiles(const Region& region, uint32_t size);
+
+/**
+ * Accumulates color samples for every pixel of an image.
+ * A pixel must only be written by one thread at a time.
+ */
+class Film
+{
+public:
+	Film(uint32_t width, uint32_t height) : width(width), height(height), sums(width * height), counts(width * height) {}
+
+	uint32_t get_width() const { return width; }
+	uint32_t get_height() const { return height; }
+
+	/**
+	 * Adds a new sample to a pixel.
+	 */
+	void add_sample(uint32_t x, uint32_t y, Color sample)
+	{
+		size_t index = y * width + x;
+		sums[index] = sums[index] + sample;
+		++counts[index];
+	}
+
+	/**
+	 * Returns the average of all the samples of a pixel, or black if the pixel has no sample.
+	 */
+	Color get_color(uint32_t x, uint32_t y) const
+	{
+		size_t index = y * width + x;
+		if (counts[index] == 0) return Color();
+		return sums[index] / static_cast<float>(counts[index]);
+	}
+
+	/**
+	 * Averages the samples of all pixels to form an image.
+	 * @param stride If above one, only the top left pixel of every stride by stride block is read
+	 * and its color is repeated over the whole block. This upsamples a partially rendered coarse pass.
+	 * @param window If not empty, the region that was rendered. Blocks are clamped to start at the
+	 * first pixel the coarse pass sampled inside the window, so pixels never read from outside it.
+	 */
+	std::vector<Color> resolve(uint32_t stride = 1, const Region& window = {}) const;
+
+private:
+	uint32_t width, height;
+	LargeVector<Color> sums;
+	LargeVector<uint32_t> counts;
+};
+
 /**
  * Outputs a series of colors as a PNG image file.
  */
 void write_image(const std::string& filename, uint32_t width, uint32_t height, const Color* colors);
+
+/**
+ * Outputs a series of values as a false color PNG image file, from blue (low) through green to red (high).
+ * Values are normalized to the 99th percentile of the positive values so that a few outliers do not hide the rest.
+ */
+void write_heatmap(const std::string& filename, uint32_t width, uint32_t height, const float* values);
+
+/**
+ * Outputs a series of colors without any conversion as a PFM (portable float map) image file.
+ */
+void write_float_image(const std::string& filename, uint32_t width, uint32_t height, const Color* colors);
+
+/**
+ * The difference between an image and a reference image.
+ */
+struct ImageError
+{
+	double mse = 0.0;          //Mean squared error
+	double relative_mse = 0.0; //Mean squared error divided by the squared reference value
+	double ssim = 0.0;         //Mean structural similarity of the luminance in 8x8 blocks
+};
+
+/**
+ * Compares an image against a reference image of the same size in parallel.
+ */
+ImageError compare_images(uint32_t width, uint32_t height, const Color* colors, const Color* reference);
+
+/**
+ * Reads a PFM image file written by write_float_image.
+ * @param width Outputs the width of the image.
+ * @param height Outputs the height of the image.
+ */
+std::vector<Color> read_float_image(const std::string& filename, uint32_t& width, uint32_t& height);
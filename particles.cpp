@@ -0,0 +1,333 @@
+#include "library.hpp"
+
+#include <fstream>
+#include <cstring>
+#include <numeric>
+#include <stdexcept>
+#include <algorithm>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+constexpr char ParticleMagic[8] = { 'P', 'A', 'R', 'T', 'I', 'C', '0', '1' };
+constexpr float PositionLevels = 65535.0f;
+constexpr float RadiusLevels = 255.0f;
+
+struct ParticleFileHeader
+{
+	char magic[8];
+	uint64_t group_count;
+};
+
+struct ParticleGroupHeader
+{
+	uint64_t count;
+	float radius; //Zero if the radius of every particle follows its center
+	uint32_t material;
+};
+
+static float get_axis(Vec3 value, uint32_t axis) { return axis == 0 ? value.x : axis == 1 ? value.y : value.z; }
+
+static Vec3 decode_position(const ParticleLeaf& leaf, uint32_t index)
+{
+	Vec3 quantized(leaf.positions[0][index], leaf.positions[1][index], leaf.positions[2][index]);
+	return quantized * leaf.step;
+}
+
+static float decode_radius(const ParticleLeaf& leaf, uint32_t index) { return static_cast<float>(leaf.radii[index]) * leaf.radius_step; }
+
+/**
+ * Quantizes the particles between two pointers to indices into a leaf, relative to the bounds of their centers.
+ */
+static ParticleLeaf make_leaf(const Vec3* positions, const float* radii, const uint32_t* begin, const uint32_t* end, float radius, uint32_t material)
+{
+	ParticleLeaf leaf;
+	leaf.material = material;
+	leaf.count = static_cast<uint32_t>(end - begin);
+
+	Vec3 min(Infinity);
+	Vec3 max(-Infinity);
+	float largest = 0.0f;
+
+	for (const uint32_t* index = begin; index != end; ++index)
+	{
+		Vec3 position = positions[*index];
+		min = Vec3(std::min(min.x, position.x), std::min(min.y, position.y), std::min(min.z, position.z));
+		max = Vec3(std::max(max.x, position.x), std::max(max.y, position.y), std::max(max.z, position.z));
+		largest = std::max(largest, radii == nullptr ? radius : radii[*index]);
+	}
+
+	//A single step for all axes, so the cell of the leaf is a cube over its largest extent
+	Vec3 extent = max - min;
+	leaf.origin = min;
+	leaf.step = std::max({ extent.x, extent.y, extent.z }) / PositionLevels;
+	leaf.radius_step = largest / RadiusLevels;
+
+	for (uint32_t i = 0; i < leaf.count; ++i)
+	{
+		Vec3 position = positions[begin[i]];
+
+		for (uint32_t axis = 0; axis < 3; ++axis)
+		{
+			float offset = get_axis(position, axis) - get_axis(min, axis);
+			float quantized = leaf.step > 0.0f ? std::round(offset / leaf.step) : 0.0f;
+			leaf.positions[axis][i] = static_cast<uint16_t>(std::clamp(quantized, 0.0f, PositionLevels));
+		}
+
+		//Rounds to the nearest level, but never to zero which marks unused slots
+		float particle_radius = radii == nullptr ? radius : radii[begin[i]];
+		float quantized = leaf.radius_step > 0.0f ? std::round(particle_radius / leaf.radius_step) : 0.0f;
+		leaf.radii[i] = static_cast<uint8_t>(std::clamp(quantized, particle_radius > 0.0f ? 1.0f : 0.0f, RadiusLevels));
+	}
+
+	return leaf;
+}
+
+/**
+ * Splits the particles between two pointers to indices at the median of the longest axis of their centers, until they fill a leaf.
+ * The left side always receives a multiple of ParticleLeafSize particles, so every leaf but the last one of a group is full.
+ */
+static void split_particles(const Vec3* positions, const float* radii, uint32_t* begin, uint32_t* end, float radius, uint32_t material,
+                            LargeVector<ParticleLeaf>& leaves)
+{
+	size_t count = end - begin;
+
+	if (count <= ParticleLeafSize)
+	{
+		leaves.push_back(make_leaf(positions, radii, begin, end, radius, material));
+		return;
+	}
+
+	Vec3 min(Infinity);
+	Vec3 max(-Infinity);
+
+	for (const uint32_t* index = begin; index != end; ++index)
+	{
+		Vec3 position = positions[*index];
+		min = Vec3(std::min(min.x, position.x), std::min(min.y, position.y), std::min(min.z, position.z));
+		max = Vec3(std::max(max.x, position.x), std::max(max.y, position.y), std::max(max.z, position.z));
+	}
+
+	Vec3 extent = max - min;
+	uint32_t axis = extent.x > extent.y && extent.x > extent.z ? 0 : extent.y > extent.z ? 1 : 2;
+	size_t leaves_left = (count / 2 + ParticleLeafSize - 1) / ParticleLeafSize;
+	uint32_t* middle = begin + leaves_left * ParticleLeafSize;
+
+	std::nth_element(begin, middle, end, [&](uint32_t value, uint32_t other)
+	{
+		return get_axis(positions[value], axis) < get_axis(positions[other], axis);
+	});
+
+	split_particles(positions, radii, begin, middle, radius, material, leaves);
+	split_particles(positions, radii, middle, end, radius, material, leaves);
+}
+
+PrimitiveID Scene::insert_particles(const Vec3* positions, const float* radii, size_t count, float radius, uint32_t material)
+{
+	if (count > std::numeric_limits<uint32_t>::max()) throw std::invalid_argument("Too many particles in one group.");
+
+	bvh.clear();
+	PrimitiveID first = make_primitive_id(PrimitiveKind::Particles, particles.size());
+	if (count == 0) return first;
+
+	std::vector<uint32_t> indices(count);
+	std::iota(indices.begin(), indices.end(), 0U);
+
+	split_particles(positions, radii, indices.data(), indices.data() + count, radius, material, particles);
+	return first;
+}
+
+void Scene::read_particles(const std::string& filename)
+{
+	int file = open(filename.c_str(), O_RDONLY);
+	if (file < 0) throw std::runtime_error("Error in when reading particles: " + filename);
+
+	struct stat status;
+	fstat(file, &status);
+	size_t size = static_cast<size_t>(status.st_size);
+
+	void* pointer = size < sizeof(ParticleFileHeader) ? MAP_FAILED : mmap(nullptr, size, PROT_READ, MAP_PRIVATE, file, 0);
+	close(file);
+	if (pointer == MAP_FAILED) throw std::runtime_error("Error in when reading particles: " + filename);
+
+	const auto* mapping = static_cast<const std::byte*>(pointer);
+	ParticleFileHeader header;
+	std::memcpy(&header, mapping, sizeof(header));
+
+	size_t offset = sizeof(header);
+	bool valid = std::memcmp(header.magic, ParticleMagic, sizeof(ParticleMagic)) == 0;
+
+	//The groups are checked first, so the leaves of all of them are reserved at once rather than growing group by group
+	std::vector<std::pair<size_t, ParticleGroupHeader>> groups;
+	size_t leaves = 0;
+
+	for (uint64_t group = 0; valid && group < header.group_count; ++group)
+	{
+		ParticleGroupHeader group_header;
+		valid = size - offset >= sizeof(group_header);
+		if (not valid) break;
+
+		std::memcpy(&group_header, mapping + offset, sizeof(group_header));
+		offset += sizeof(group_header);
+
+		//The headers and records are all multiples of four bytes, so the centers and radii are aligned in the mapping
+		size_t particle_size = sizeof(Vec3) + (group_header.radius == 0.0f ? sizeof(float) : 0);
+		valid = group_header.count <= (size - offset) / particle_size && not (group_header.radius < 0.0f);
+		if (not valid) break;
+
+		groups.emplace_back(offset, group_header);
+		leaves += (group_header.count + ParticleLeafSize - 1) / ParticleLeafSize;
+		offset += group_header.count * particle_size;
+	}
+
+	if (not valid)
+	{
+		munmap(pointer, size);
+		throw std::runtime_error("Invalid particles: " + filename);
+	}
+
+	particles.reserve(particles.size() + leaves);
+
+	for (const auto& [group_offset, group_header] : groups)
+	{
+		const auto* positions = reinterpret_cast<const Vec3*>(mapping + group_offset);
+		const auto* radii = group_header.radius == 0.0f ? reinterpret_cast<const float*>(mapping + group_offset + group_header.count * sizeof(Vec3)) : nullptr;
+		insert_particles(positions, radii, group_header.count, group_header.radius, group_header.material);
+	}
+
+	munmap(pointer, size);
+}
+
+void Scene::write_particles(const std::string& filename) const
+{
+	std::ofstream stream(filename, std::ios::binary);
+
+	//Consecutive leaves of the same material are written as one group
+	std::vector<std::pair<size_t, size_t>> groups;
+
+	for (size_t i = 0; i < particles.size(); ++i)
+	{
+		if (groups.empty() || particles[groups.back().second - 1].material != particles[i].material) groups.emplace_back(i, i);
+		++groups.back().second;
+	}
+
+	ParticleFileHeader header;
+	std::memcpy(header.magic, ParticleMagic, sizeof(ParticleMagic));
+	header.group_count = groups.size();
+	stream.write(reinterpret_cast<const char*>(&header), sizeof(header));
+
+	std::vector<Vec3> positions;
+	std::vector<float> radii;
+
+	for (auto [begin, end] : groups)
+	{
+		positions.clear();
+		radii.clear();
+
+		for (size_t i = begin; i < end; ++i)
+		{
+			const ParticleLeaf& leaf = particles[i];
+
+			for (uint32_t j = 0; j < leaf.count; ++j)
+			{
+				positions.push_back(leaf.origin + decode_position(leaf, j));
+				radii.push_back(decode_radius(leaf, j));
+			}
+		}
+
+		bool shared = std::all_of(radii.begin(), radii.end(), [&](float radius) { return radius == radii.front() && radius > 0.0f; });
+		ParticleGroupHeader group_header{ positions.size(), shared ? radii.front() : 0.0f, particles[begin].material };
+
+		stream.write(reinterpret_cast<const char*>(&group_header), sizeof(group_header));
+		stream.write(reinterpret_cast<const char*>(positions.data()), static_cast<std::streamsize>(positions.size() * sizeof(Vec3)));
+		if (not shared) stream.write(reinterpret_cast<const char*>(radii.data()), static_cast<std::streamsize>(radii.size() * sizeof(float)));
+	}
+
+	if (not stream) throw std::runtime_error("Error in when outputting particles.");
+}
+
+void get_particle_bounds(const ParticleLeaf& leaf, Vec3& min, Vec3& max)
+{
+	min = Vec3(Infinity);
+	max = Vec3(-Infinity);
+
+	for (uint32_t i = 0; i < leaf.count; ++i)
+	{
+		Vec3 center = leaf.origin + decode_position(leaf, i);
+		float radius = decode_radius(leaf, i);
+		min = Vec3(std::min(min.x, center.x - radius), std::min(min.y, center.y - radius), std::min(min.z, center.z - radius));
+		max = Vec3(std::max(max.x, center.x + radius), std::max(max.y, center.y + radius), std::max(max.z, center.z + radius));
+	}
+}
+
+float intersect_particles(const Ray& ray, const ParticleLeaf& leaf, float limit, Vec3& normal)
+{
+	//Relative to the origin of the leaf, which keeps the precision of the quantized centers.
+	//Every lane is intersect_sphere without branches: a lane that misses or is past the limit becomes Infinity.
+	Vec3 origin = ray.origin - leaf.origin;
+	alignas(16) float distances[ParticleLeafSize];
+
+#if defined(__SSE2__)
+	const __m128i zero = _mm_setzero_si128();
+	const __m128 step = _mm_set1_ps(leaf.step);
+	const __m128 radius_step = _mm_set1_ps(leaf.radius_step);
+	const __m128 infinity = _mm_set1_ps(Infinity);
+	const __m128 limits = _mm_set1_ps(limit);
+	const __m128 directions[3] = { _mm_set1_ps(ray.direction.x), _mm_set1_ps(ray.direction.y), _mm_set1_ps(ray.direction.z) };
+	const __m128 origins[3] = { _mm_set1_ps(origin.x), _mm_set1_ps(origin.y), _mm_set1_ps(origin.z) };
+
+	__m128i positions[3];
+	for (uint32_t axis = 0; axis < 3; ++axis) positions[axis] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(leaf.positions[axis]));
+	__m128i radii = _mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(leaf.radii)), zero);
+
+	for (uint32_t half = 0; half < 2; ++half)
+	{
+		auto widen = [&](__m128i values) { return _mm_cvtepi32_ps(half == 0 ? _mm_unpacklo_epi16(values, zero) : _mm_unpackhi_epi16(values, zero)); };
+
+		__m128 offsets[3];
+		for (uint32_t axis = 0; axis < 3; ++axis) offsets[axis] = _mm_sub_ps(origins[axis], _mm_mul_ps(widen(positions[axis]), step));
+
+		__m128 radius = _mm_mul_ps(widen(radii), radius_step);
+		__m128 mapped = _mm_sub_ps(_mm_setzero_ps(), _mm_add_ps(_mm_add_ps(_mm_mul_ps(offsets[0], directions[0]), _mm_mul_ps(offsets[1], directions[1])),
+		                                                        _mm_mul_ps(offsets[2], directions[2])));
+		__m128 length2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(offsets[0], offsets[0]), _mm_mul_ps(offsets[1], offsets[1])), _mm_mul_ps(offsets[2], offsets[2]));
+		__m128 extend2 = _mm_sub_ps(_mm_add_ps(_mm_mul_ps(mapped, mapped), _mm_mul_ps(radius, radius)), length2);
+		__m128 extend = _mm_sqrt_ps(_mm_max_ps(extend2, _mm_setzero_ps()));
+
+		__m128 near = _mm_sub_ps(mapped, extend);
+		__m128 far = _mm_add_ps(mapped, extend);
+		__m128 use_near = _mm_cmpge_ps(near, _mm_setzero_ps());
+		__m128 distance = _mm_or_ps(_mm_and_ps(use_near, near), _mm_andnot_ps(use_near, far));
+
+		//Unused slots have a zero radius, but a ray through their center would still touch them
+		__m128 used = _mm_cmpgt_ps(radius, _mm_setzero_ps());
+		__m128 hit = _mm_and_ps(_mm_and_ps(_mm_cmpge_ps(extend2, _mm_setzero_ps()), _mm_cmpge_ps(distance, _mm_setzero_ps())), _mm_and_ps(_mm_cmplt_ps(distance, limits), used));
+		_mm_store_ps(distances + half * 4, _mm_or_ps(_mm_and_ps(hit, distance), _mm_andnot_ps(hit, infinity)));
+	}
+#else
+	for (uint32_t i = 0; i < ParticleLeafSize; ++i)
+	{
+		Vec3 offset = origin - decode_position(leaf, i);
+		float radius = decode_radius(leaf, i);
+		float mapped = -dot(offset, ray.direction);
+		float extend2 = mapped * mapped + radius * radius - magnitude_squared(offset);
+		float extend = std::sqrt(std::max(extend2, 0.0f));
+		float distance = mapped - extend >= 0.0f ? mapped - extend : mapped + extend;
+		distances[i] = radius > 0.0f && extend2 >= 0.0f && distance >= 0.0f && distance < limit ? distance : Infinity;
+	}
+#endif
+
+	uint32_t closest = 0;
+	for (uint32_t i = 1; i < ParticleLeafSize; ++i) closest = distances[i] < distances[closest] ? i : closest;
+	if (distances[closest] == Infinity) return Infinity;
+
+	Vec3 offset = origin - decode_position(leaf, closest);
+	normal = normalize(ray.direction * distances[closest] + offset);
+	return distances[closest];
+}
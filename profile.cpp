@@ -0,0 +1,542 @@
+#include "profile.hpp"
+
+#include <mutex>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <bit>
+#include <algorithm>
+#include <string_view>
+
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+#include <memory>
+#include <vector>
+#include <new>
+#include <cstdlib>
+#include <iomanip>
+
+static std::mutex statistics_mutex;
+static std::vector<std::unique_ptr<Statistics>> all_statistics;
+static std::vector<Statistics*> free_statistics;
+
+struct Stage
+{
+	const char* name;
+	double seconds;
+	uint64_t allocations;
+};
+
+static std::vector<Stage> stages;
+
+/**
+ * Hands the counters of a thread back when the thread exits. The counters keep their values, so the
+ * next thread continues to add to them and the number of counters is bounded by the threads alive at once.
+ */
+struct StatisticsOwner
+{
+	~StatisticsOwner()
+	{
+		if (statistics == nullptr) return;
+		std::lock_guard lock(statistics_mutex);
+		free_statistics.push_back(statistics);
+	}
+
+	Statistics* statistics = nullptr;
+};
+
+thread_local StatisticsOwner statistics_owner;
+
+std::atomic<bool> tracing_enabled = false;
+
+static std::atomic<uint64_t> heap_allocations = 0;
+
+uint64_t get_heap_allocations() { return heap_allocations.load(std::memory_order_relaxed); }
+
+#ifdef ENABLE_STATISTICS
+
+//Replaces the global allocation functions to count every heap allocation of the program
+void* operator new(size_t size)
+{
+	heap_allocations.fetch_add(1, std::memory_order_relaxed);
+	if (void* pointer = std::malloc(size == 0 ? 1 : size)) return pointer;
+	throw std::bad_alloc();
+}
+
+void* operator new(size_t size, std::align_val_t alignment)
+{
+	heap_allocations.fetch_add(1, std::memory_order_relaxed);
+	void* pointer;
+	size_t bytes = std::max(size, sizeof(void*));
+	if (posix_memalign(&pointer, std::max(static_cast<size_t>(alignment), sizeof(void*)), bytes) == 0) return pointer;
+	throw std::bad_alloc();
+}
+
+void operator delete(void* pointer) noexcept { std::free(pointer); }
+void operator delete(void* pointer, size_t) noexcept { std::free(pointer); }
+void operator delete(void* pointer, std::align_val_t) noexcept { std::free(pointer); }
+void operator delete(void* pointer, size_t, std::align_val_t) noexcept { std::free(pointer); }
+
+#endif
+
+struct TraceEvent
+{
+	const char* name;
+	uint64_t begin;
+	uint64_t end;
+};
+
+/**
+ * A ring buffer of spans written by a single thread at a time.
+ */
+struct TraceBuffer
+{
+	void push(const TraceEvent& event)
+	{
+		uint64_t index = head.load(std::memory_order_relaxed);
+		events[index % TraceCapacity] = event;
+		head.store(index + 1, std::memory_order_release);
+	}
+
+	std::array<TraceEvent, TraceCapacity> events;
+	std::atomic<uint64_t> head = 0;
+};
+
+static std::mutex trace_mutex;
+static std::vector<std::unique_ptr<TraceBuffer>> trace_buffers;
+static std::vector<TraceBuffer*> free_trace_buffers;
+
+/**
+ * Hands the buffer of a thread back when the thread exits. Threads of different parallel_for
+ * calls then reuse the same buffers, which become the rows of the trace.
+ */
+struct TraceBufferOwner
+{
+	~TraceBufferOwner()
+	{
+		if (buffer == nullptr) return;
+		std::lock_guard lock(trace_mutex);
+		free_trace_buffers.push_back(buffer);
+	}
+
+	TraceBuffer* buffer = nullptr;
+};
+
+thread_local TraceBufferOwner trace_buffer_owner;
+
+void Statistics::add_path(uint32_t length)
+{
+	if (length == 0) return;
+	primary_rays += 1;
+	secondary_rays += length - 1;
+	size_t bin = std::bit_width(length) - 1;
+	path_lengths[std::min(bin, PathLengthBins - 1)] += 1;
+}
+
+void Statistics::merge(const Statistics& other)
+{
+	primary_rays += other.primary_rays;
+	secondary_rays += other.secondary_rays;
+	primitive_tests += other.primitive_tests;
+	node_visits += other.node_visits;
+	invalid_samples += other.invalid_samples;
+	for (size_t i = 0; i < PathLengthBins; ++i) path_lengths[i] += other.path_lengths[i];
+}
+
+Statistics& thread_statistics()
+{
+	Statistics*& statistics = statistics_owner.statistics;
+	if (statistics != nullptr) return *statistics;
+
+	//The counters are never freed, so they can be merged after their threads have exited
+	std::lock_guard lock(statistics_mutex);
+
+	if (free_statistics.empty())
+	{
+		all_statistics.push_back(std::make_unique<Statistics>());
+		statistics = all_statistics.back().get();
+	}
+	else
+	{
+		statistics = free_statistics.back();
+		free_statistics.pop_back();
+	}
+
+	return *statistics;
+}
+
+Statistics merge_statistics()
+{
+	std::lock_guard lock(statistics_mutex);
+	Statistics result;
+	for (auto& statistics : all_statistics) result.merge(*statistics);
+	return result;
+}
+
+void add_stage_time(const char* name, double seconds, uint64_t allocations)
+{
+	std::lock_guard lock(statistics_mutex);
+
+	for (auto& stage : stages)
+	{
+		if (std::string_view(stage.name) != name) continue;
+		stage.seconds += seconds;
+		stage.allocations += allocations;
+		return;
+	}
+
+	if (stages.size() < MaxStages) stages.push_back({ name, seconds, allocations });
+}
+
+void print_statistics(std::ostream& stream, const char* stage)
+{
+	double seconds = 0.0;
+	uint64_t allocations = 0;
+
+	Statistics statistics = merge_statistics();
+	uint64_t rays = statistics.primary_rays + statistics.secondary_rays;
+	auto per_ray = [rays](uint64_t value) { return rays == 0 ? 0.0 : static_cast<double>(value) / static_cast<double>(rays); };
+
+	stream << std::fixed << std::setprecision(3);
+	stream << "Stages:\n";
+
+	{
+		std::lock_guard lock(statistics_mutex);
+
+		for (auto& [name, time, count] : stages)
+		{
+			stream << "  " << std::left << std::setw(16) << name << time << " s, " << count << " allocations\n";
+			if (std::string_view(name) != stage) continue;
+			seconds = time;
+			allocations = count;
+		}
+	}
+
+	stream << "Rays: " << rays << " (" << statistics.primary_rays << " primary, " << statistics.secondary_rays << " secondary)\n";
+	stream << "Rays per second: " << (seconds > 0.0 ? static_cast<double>(rays) / seconds : 0.0) << '\n';
+	stream << "Primitive tests per ray: " << per_ray(statistics.primitive_tests) << '\n';
+	stream << "Node visits per ray: " << per_ray(statistics.node_visits) << '\n';
+	stream << "Invalid samples: " << statistics.invalid_samples << '\n';
+	stream << "Heap allocations: " << allocations << " in " << stage << ", " << get_heap_allocations() << " in total\n";
+	stream << "Path lengths:\n";
+
+	uint64_t paths = 0;
+	for (uint64_t count : statistics.path_lengths) paths += count;
+
+	for (size_t i = 0; i < PathLengthBins; ++i)
+	{
+		uint64_t count = statistics.path_lengths[i];
+		if (count == 0) continue;
+
+		stream << "  " << std::right << std::setw(6) << (1U << i) << " - " << std::setw(6) << (1U << (i + 1)) - 1;
+		stream << std::setw(10) << 100.0 * static_cast<double>(count) / static_cast<double>(paths) << " %\n";
+	}
+
+	stream << std::defaultfloat;
+}
+
+uint64_t get_trace_time()
+{
+	using Clock = std::chrono::steady_clock;
+	static const Clock::time_point start = Clock::now();
+
+	//Starts at one because zero marks a span that is not recorded
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count() + 1;
+}
+
+void record_trace(const char* name, uint64_t begin, uint64_t end)
+{
+	TraceBuffer*& buffer = trace_buffer_owner.buffer;
+
+	if (buffer == nullptr)
+	{
+		std::lock_guard lock(trace_mutex);
+
+		if (free_trace_buffers.empty())
+		{
+			trace_buffers.push_back(std::make_unique<TraceBuffer>());
+			buffer = trace_buffers.back().get();
+		}
+		else
+		{
+			buffer = free_trace_buffers.back();
+			free_trace_buffers.pop_back();
+		}
+	}
+
+	buffer->push({ name, begin, end });
+}
+
+void write_trace(const std::string& filename)
+{
+	std::lock_guard lock(trace_mutex);
+	std::ofstream stream(filename);
+	stream << std::fixed << std::setprecision(3);
+	stream << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+	bool first = true;
+
+	for (size_t thread = 0; thread < trace_buffers.size(); ++thread)
+	{
+		const TraceBuffer& buffer = *trace_buffers[thread];
+		uint64_t head = buffer.head.load(std::memory_order_acquire);
+		uint64_t begin = head > TraceCapacity ? head - TraceCapacity : 0;
+
+		if (not first) stream << ",\n";
+		stream << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << thread
+		       << ",\"args\":{\"name\":\"thread " << thread << "\"}}";
+		first = false;
+
+		for (uint64_t i = begin; i < head; ++i)
+		{
+			const TraceEvent& event = buffer.events[i % TraceCapacity];
+			stream << ",\n{\"name\":\"" << event.name << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << thread
+			       << ",\"ts\":" << static_cast<double>(event.begin) / 1000.0
+			       << ",\"dur\":" << static_cast<double>(event.end - event.begin) / 1000.0 << '}';
+		}
+	}
+
+	stream << "\n]}\n";
+	if (not stream) throw std::runtime_error("Error in when outputting trace.");
+}
+
+std::atomic<bool> perf_enabled = false;
+
+constexpr size_t PerfRegionCount = static_cast<size_t>(PerfRegion::Count);
+const char* const PerfRegionNames[PerfRegionCount] = { "intersection", "shading", "sampling", "output" };
+
+struct PerfTotals
+{
+	std::array<std::array<uint64_t, PerfEventCount>, PerfRegionCount> counts{};
+	std::array<uint64_t, PerfRegionCount> entries{};
+
+	void merge(const PerfTotals& other)
+	{
+		for (size_t region = 0; region < PerfRegionCount; ++region)
+		{
+			for (size_t i = 0; i < PerfEventCount; ++i) counts[region][i] += other.counts[region][i];
+			entries[region] += other.entries[region];
+		}
+	}
+};
+
+static std::mutex perf_mutex;
+static PerfTotals perf_totals;
+static std::array<bool, PerfEventCount> perf_available{};
+
+/**
+ * The counters opened by one thread, which only count that thread.
+ * When the kernel allows it, they are read with rdpmc through the mapped page instead of a system call.
+ */
+struct ThreadPerf
+{
+	ThreadPerf();
+	~ThreadPerf();
+
+	/**
+	 * Reads every open counter and returns a bit for every counter that was read successfully.
+	 */
+	uint32_t read(std::array<uint64_t, PerfEventCount>& values) const;
+
+	std::array<int, PerfEventCount> files;
+	std::array<void*, PerfEventCount> pages{};
+	PerfTotals totals;
+};
+
+thread_local std::unique_ptr<ThreadPerf> thread_perf;
+
+#ifdef __linux__
+
+static int open_perf_event(size_t index)
+{
+	constexpr std::pair<uint32_t, uint64_t> Events[PerfEventCount] =
+	{
+		{ PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK },
+		{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+		{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+		{ PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D | PERF_COUNT_HW_CACHE_OP_READ << 8 | PERF_COUNT_HW_CACHE_RESULT_MISS << 16 },
+		{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+		{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+		{ PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_DTLB | PERF_COUNT_HW_CACHE_OP_READ << 8 | PERF_COUNT_HW_CACHE_RESULT_MISS << 16 }
+	};
+
+	perf_event_attr attributes;
+	std::memset(&attributes, 0, sizeof(attributes));
+	attributes.size = sizeof(attributes);
+	attributes.type = Events[index].first;
+	attributes.config = Events[index].second;
+	attributes.exclude_kernel = 1;
+	attributes.exclude_hv = 1;
+
+	return static_cast<int>(syscall(SYS_perf_event_open, &attributes, 0, -1, -1, 0));
+}
+
+ThreadPerf::ThreadPerf()
+{
+	for (size_t i = 0; i < PerfEventCount; ++i)
+	{
+		files[i] = open_perf_event(i);
+		if (files[i] < 0) continue;
+
+		void* page = mmap(nullptr, sysconf(_SC_PAGESIZE), PROT_READ, MAP_SHARED, files[i], 0);
+		if (page != MAP_FAILED) pages[i] = page;
+	}
+}
+
+ThreadPerf::~ThreadPerf()
+{
+	for (size_t i = 0; i < PerfEventCount; ++i)
+	{
+		if (pages[i] != nullptr) munmap(pages[i], sysconf(_SC_PAGESIZE));
+		if (files[i] >= 0) close(files[i]);
+	}
+
+	std::lock_guard lock(perf_mutex);
+	perf_totals.merge(totals);
+}
+
+uint32_t ThreadPerf::read(std::array<uint64_t, PerfEventCount>& values) const
+{
+	uint32_t valid = 0;
+
+	for (size_t i = 0; i < PerfEventCount; ++i)
+	{
+		values[i] = 0;
+		if (files[i] < 0) continue;
+
+#if defined(__x86_64__) || defined(__i386__)
+		//User space read, following the protocol documented in linux/perf_event.h
+		if (auto page = static_cast<volatile perf_event_mmap_page*>(pages[i]); page != nullptr && page->cap_user_rdpmc)
+		{
+			uint32_t sequence;
+			uint32_t index;
+			int64_t count;
+
+			do
+			{
+				sequence = page->lock;
+				std::atomic_signal_fence(std::memory_order_seq_cst);
+				index = page->index;
+				count = page->offset;
+
+				if (index != 0)
+				{
+					uint32_t shift = 64 - page->pmc_width;
+					count += static_cast<int64_t>(static_cast<uint64_t>(__rdpmc(static_cast<int>(index - 1))) << shift) >> shift;
+				}
+
+				std::atomic_signal_fence(std::memory_order_seq_cst);
+			}
+			while (page->lock != sequence);
+
+			if (index != 0)
+			{
+				values[i] = static_cast<uint64_t>(count);
+				valid |= 1U << i;
+				continue;
+			}
+		}
+#endif
+
+		if (::read(files[i], &values[i], sizeof(uint64_t)) == sizeof(uint64_t)) valid |= 1U << i;
+		else values[i] = 0;
+	}
+
+	return valid;
+}
+
+bool enable_perf_counters()
+{
+	ThreadPerf probe;
+	for (size_t i = 0; i < PerfEventCount; ++i) perf_available[i] = probe.files[i] >= 0;
+
+	perf_enabled.store(perf_available[0], std::memory_order_relaxed);
+	return perf_available[0];
+}
+
+#else
+
+ThreadPerf::ThreadPerf() { files.fill(-1); }
+ThreadPerf::~ThreadPerf() {}
+uint32_t ThreadPerf::read(std::array<uint64_t, PerfEventCount>& values) const { values.fill(0); return 0; }
+bool enable_perf_counters() { return false; }
+
+#endif
+
+void PerfScope::begin()
+{
+	if (thread_perf == nullptr) thread_perf = std::make_unique<ThreadPerf>();
+	started = thread_perf->read(start);
+	active = true;
+}
+
+void PerfScope::end()
+{
+	std::array<uint64_t, PerfEventCount> values;
+	uint32_t valid = started & thread_perf->read(values);
+
+	auto index = static_cast<size_t>(region);
+	auto& counts = thread_perf->totals.counts[index];
+
+	//A counter that failed to read at either end is skipped, instead of adding a wrapped around difference
+	for (size_t i = 0; i < PerfEventCount; ++i)
+	{
+		if ((valid >> i & 1U) != 0 && values[i] >= start[i]) counts[i] += values[i] - start[i];
+	}
+
+	++thread_perf->totals.entries[index];
+}
+
+void print_perf_counters(std::ostream& stream)
+{
+	PerfTotals totals;
+
+	{
+		std::lock_guard lock(perf_mutex);
+		totals = perf_totals;
+	}
+
+	//Also includes the calling thread, whose counters are only merged when it exits
+	if (thread_perf != nullptr) totals.merge(thread_perf->totals);
+
+	const char* const names[PerfEventCount] = { "ms", "cycles", "instructions", "L1D misses", "cache misses", "branch misses", "dTLB misses" };
+	double rays = static_cast<double>(totals.entries[static_cast<size_t>(PerfRegion::Intersection)]);
+
+	stream << std::fixed << std::setprecision(3);
+	stream << "Performance counters (" << static_cast<uint64_t>(rays) << " rays):\n";
+
+	for (size_t region = 0; region < PerfRegionCount; ++region)
+	{
+		const auto& counts = totals.counts[region];
+		stream << "  " << PerfRegionNames[region] << ":\n";
+
+		for (size_t i = 0; i < PerfEventCount; ++i)
+		{
+			stream << "    " << std::left << std::setw(16) << names[i] << std::right;
+
+			if (not perf_available[i])
+			{
+				stream << "unavailable\n";
+				continue;
+			}
+
+			double value = static_cast<double>(counts[i]);
+			if (i == 0) value /= 1E6; //The task clock counts nanoseconds
+
+			stream << std::setw(20) << value;
+			if (i > 0 && rays > 0.0) stream << std::setw(16) << value / rays << " per ray";
+			stream << '\n';
+		}
+
+		if (perf_available[1] && perf_available[2] && counts[1] > 0)
+		{
+			stream << "    " << std::left << std::setw(16) << "IPC" << std::right << std::setw(20)
+			       << static_cast<double>(counts[2]) / static_cast<double>(counts[1]) << '\n';
+		}
+	}
+
+	stream << std::defaultfloat;
+}
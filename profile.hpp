@@ -0,0 +1,215 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <cstdint>
+#include <ostream>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+//Define ENABLE_STATISTICS to collect the counters below, otherwise every STATISTIC compiles to nothing
+#ifdef ENABLE_STATISTICS
+#define STATISTIC(expression) (thread_statistics().expression)
+#define STATISTIC_STAGE(name) ScopedStage stage_timer(name)
+#else
+#define STATISTIC(expression) ((void)0)
+#define STATISTIC_STAGE(name) ((void)0)
+#endif
+
+constexpr size_t PathLengthBins = 16;
+constexpr size_t MaxStages = 8;
+constexpr size_t TraceCapacity = 1 << 16;
+
+/**
+ * Counters of the work done by the renderer.
+ * Every thread increments its own copy, which occupies separate cache lines to avoid false sharing.
+ */
+struct alignas(64) Statistics
+{
+	uint64_t primary_rays = 0;
+	uint64_t secondary_rays = 0;
+	uint64_t primitive_tests = 0;
+	uint64_t node_visits = 0;
+	uint64_t invalid_samples = 0;
+
+	//The number of paths by number of rays, bin i counts lengths from 2^i up to (excluding) 2^(i + 1)
+	std::array<uint64_t, PathLengthBins> path_lengths{};
+
+	/**
+	 * Counts a path and its rays.
+	 * @param length The number of rays traced by the path, the first one being the primary ray.
+	 */
+	void add_path(uint32_t length);
+
+	void merge(const Statistics& other);
+};
+
+/**
+ * Returns the Statistics of the calling thread, taken the first time a thread calls this.
+ * The counters of exited threads are reused, so they accumulate across parallel_for calls.
+ */
+Statistics& thread_statistics();
+
+/**
+ * Sums the Statistics of all threads that ever called thread_statistics.
+ * Should only be called while no other thread is incrementing its counters.
+ */
+Statistics merge_statistics();
+
+/**
+ * Adds to the total time spent in a named stage of the program.
+ * @param name Must stay valid until the program ends, such as a string literal.
+ * @param allocations The heap allocations made by any thread while the stage ran, see get_heap_allocations.
+ */
+void add_stage_time(const char* name, double seconds, uint64_t allocations = 0);
+
+/**
+ * Returns the number of heap allocations made through operator new so far, which are only counted with ENABLE_STATISTICS.
+ */
+uint64_t get_heap_allocations();
+
+/**
+ * Outputs a summary of the merged Statistics and the stage times, including the rays per second.
+ * @param stage The name of the stage whose time the rays per second is computed over, and whose heap allocations are reported.
+ */
+void print_statistics(std::ostream& stream, const char* stage);
+
+/**
+ * Returns a fast, monotonically increasing counter of elapsed time.
+ * This is the time stamp counter on x86 and nanoseconds elsewhere, so values are only comparable on one machine.
+ */
+inline uint64_t read_cycle_counter()
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	return std::chrono::steady_clock::now().time_since_epoch().count();
+#endif
+}
+
+/**
+ * Measures the time and the heap allocations from its construction to its destruction as a stage, see add_stage_time.
+ */
+class ScopedStage
+{
+public:
+	explicit ScopedStage(const char* name) : name(name), start(std::chrono::steady_clock::now()), allocations(get_heap_allocations()) {}
+
+	~ScopedStage()
+	{
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		add_stage_time(name, seconds, get_heap_allocations() - allocations);
+	}
+
+	ScopedStage(const ScopedStage&) = delete;
+	ScopedStage& operator=(const ScopedStage&) = delete;
+
+private:
+	const char* name;
+	std::chrono::steady_clock::time_point start;
+	uint64_t allocations;
+};
+
+/**
+ * Whether spans are being recorded, see set_tracing.
+ */
+extern std::atomic<bool> tracing_enabled;
+
+/**
+ * Starts or stops recording spans, which is off by default.
+ */
+inline void set_tracing(bool enabled) { tracing_enabled.store(enabled, std::memory_order_relaxed); }
+inline bool is_tracing() { return tracing_enabled.load(std::memory_order_relaxed); }
+
+/**
+ * Returns the current time in nanoseconds since the first call, as used by trace spans.
+ */
+uint64_t get_trace_time();
+
+/**
+ * Records a span of time spent by the calling thread.
+ * Every thread writes into its own ring buffer without locking, which keeps the most recent TraceCapacity spans.
+ * @param name Must stay valid until the trace is written, such as a string literal.
+ */
+void record_trace(const char* name, uint64_t begin, uint64_t end);
+
+/**
+ * Outputs all recorded spans as a Chrome trace (JSON), which can be opened in Perfetto or chrome://tracing.
+ * Should only be called while no other thread is recording spans.
+ */
+void write_trace(const std::string& filename);
+
+/**
+ * Records the time from its construction to its destruction as a span if tracing is enabled.
+ */
+class TraceSpan
+{
+public:
+	explicit TraceSpan(const char* name) : name(name), begin(is_tracing() ? get_trace_time() : 0) {}
+	~TraceSpan() { if (begin != 0) record_trace(name, begin, get_trace_time()); }
+
+	TraceSpan(const TraceSpan&) = delete;
+	TraceSpan& operator=(const TraceSpan&) = delete;
+
+private:
+	const char* name;
+	uint64_t begin;
+};
+
+enum class PerfRegion : uint32_t
+{
+	Intersection,
+	Shading,
+	Sampling,
+	Output,
+	Count
+};
+
+constexpr size_t PerfEventCount = 7;
+
+/**
+ * Whether hardware performance counters are being collected, see enable_perf_counters.
+ */
+extern std::atomic<bool> perf_enabled;
+
+inline bool is_perf_enabled() { return perf_enabled.load(std::memory_order_relaxed); }
+
+/**
+ * Starts collecting Linux performance counters (task clock, cycles, instructions, L1 data misses,
+ * last level cache misses, branch misses and data TLB misses) for every thread that enters a PerfScope.
+ * Counters are read with rdpmc when the kernel allows it, otherwise every read is a system call which inflates small regions.
+ * @return Whether at least the task clock could be opened. Hardware events missing on this machine are reported as unavailable.
+ */
+bool enable_perf_counters();
+
+/**
+ * Outputs the counters collected per PerfRegion, with the instructions per cycle and the events per ray.
+ * A ray is counted for every entry of the intersection region.
+ */
+void print_perf_counters(std::ostream& stream);
+
+/**
+ * Adds the counter deltas from its construction to its destruction to a region, if performance counters are enabled.
+ */
+class PerfScope
+{
+public:
+	explicit PerfScope(PerfRegion region) : region(region) { if (is_perf_enabled()) begin(); }
+	~PerfScope() { if (active) end(); }
+
+	PerfScope(const PerfScope&) = delete;
+	PerfScope& operator=(const PerfScope&) = delete;
+
+private:
+	void begin();
+	void end();
+
+	PerfRegion region;
+	bool active = false;
+	uint32_t started = 0; //A bit for every counter that was read successfully at the start
+	std::array<uint64_t, PerfEventCount> start;
+};
@@ -2,103 +2,126 @@
 #ifdef COMPILE_REFERENCE
 
 #include "library.hpp"
+#include "profile.hpp"
 
 #include <vector>
+#include <string>
+#include <chrono>
+#include <thread>
+#include <sstream>
+#include <fstream>
+#include <exception>
+#include <optional>
+#include <iostream>
+#include <stdexcept>
+#include <numeric>
+#include <algorithm>
+#include <map>
+#include <mutex>
+#include <atomic>
+#include <cstring>
+#include <unistd.h>
 
 constexpr uint32_t ImageWidth = 512 * 4;
 constexpr uint32_t ImageHeight = 512 * 4;
 constexpr uint32_t SamplesPerPixel = 64 * 16;
 constexpr uint32_t MaxBounces = 128;
 
-Scene make_scene()
-{
-	Scene scene;
+//Strides of the preview passes (1/16 and 1/4 of the pixels), each must be a multiple of the next
+constexpr uint32_t PreviewStrides[] = { 4, 2 };
 
-	//Cornell box interior scene
-	scene.insert_plane({ 0.0f, 1.0f, 0.0f }, 0.0f, 0);
-	scene.insert_plane({ 0.0f, 0.0f, -1.0f }, 5.0f, 3);
-	scene.insert_plane({ 1.0f, 0.0f, 0.0f }, 5.0f, 1);
-	scene.insert_plane({ 0.0f, -1.0f, 0.0f }, 10.0f, 0);
-	scene.insert_plane({ -1.0f, 0.0f, 0.0f }, 5.0f, 2);
+constexpr uint32_t TileSize = 32;
+constexpr uint32_t PrioritySampleScale = 4;
 
-	scene.insert_sphere({ -2.5f, 2.0f, 1.5f }, 2.0f, 4);
-	scene.insert_sphere({ 2.0f, 2.0f, -2.5f }, 2.0f, 5);
-	scene.insert_box({ 0.0f, 8.75f, 0.0f }, { 6.0f, 0.1f, 6.0f }, 5);
-	scene.insert_box({ 0.0f, 8.25f, 0.0f }, { 6.0f, 0.1f, 6.0f }, 5);
-	scene.insert_box({ 0.0f, 7.75f, 0.0f }, { 6.0f, 0.1f, 6.0f }, 5);
-	scene.insert_box({ 0.0f, 7.25f, 0.0f }, { 6.0f, 0.1f, 6.0f }, 5);
-	scene.insert_box({ 0.0f, 6.75f, 0.0f }, { 6.0f, 0.1f, 6.0f }, 5);
-	scene.insert_box({ 0.0f, 6.25f, 0.0f }, { 6.0f, 0.1f, 6.0f }, 5);
-	scene.insert_box({ 0.0f, 5.75f, 0.0f }, { 6.0f, 0.1f, 6.0f }, 5);
-	scene.insert_box({ 0.0f, 5.25f, 0.0f }, { 6.0f, 0.1f, 6.0f }, 5);
-	scene.insert_box({ 0.0f, 4.75f, 0.0f }, { 6.0f, 0.1f, 6.0f }, 5);
+//Paths in flight at once per thread in the wavefront mode, which take 32 bytes each
+constexpr uint32_t WavefrontPaths = 1 << 16;
 
-	//	scene.insert_box({ 0.0f, 9.5f, 0.0f }, { 6.0f, 0.2f, 6.0f }, 10);
-	scene.insert_box({ -2.05f, 9.5f, 0.0f }, { 1.9f, 0.2f, 6.0f }, 11);
-	scene.insert_box({ 0.0f, 9.5f, 0.0f }, { 1.9f, 0.2f, 6.0f }, 12);
-	scene.insert_box({ 2.05f, 9.5f, 0.0f }, { 1.9f, 0.2f, 6.0f }, 13);
+//Paths in flight at once in the out-of-core mode, whose batches of rays are larger so that chunks are paged in less often.
+//Larger windows are rendered in bands of at most this many pixels, which bounds the memory of the paths.
+constexpr uint32_t OutOfCorePaths = 1 << 20;
+constexpr uint32_t OutOfCoreBlock = 1 << 12; //Pixels or paths per work item when the threads share a wave
 
-	return scene;
-}
+//Calibration renders of the auto-tuner, which times a few samples of blocks spread over the image
+constexpr uint32_t CalibrationSamples = 2;
+constexpr uint32_t CalibrationBlockSize = 64;
+constexpr uint32_t CalibrationTileSizes[] = { 8, 16, 32, 64 };
+constexpr uint32_t CalibrationGrains[] = { 1, 2, 4, 8 };
 
-const Scene Scene = make_scene();
+//Cost estimate of the tiles split across nodes when no previous frame was measured
+constexpr uint32_t PrePassSamples = 1;
+constexpr uint32_t PrePassStride = 4;
+constexpr double BalanceTimeout = 600.0; //Seconds to wait for the costs of the other nodes
 
-Color bsdf_lambertian_reflection(Vec3 outgoing, Vec3 normal, Vec3& incident)
-{
-	//Uniform sampling
-	//	incident = random_on_sphere();
-	//	float pdf = 1.0f / Pi / 2.0f;
+//Cornell box interior scene camera
+const Vec3 CameraOrigin(0.0f, 5.0f, -20.0f);
+constexpr float CameraFocal = 1.5f;
 
-	//Importance sampling based on cosine distribution
-	incident = random_cosine_hemisphere(normal);
-	float pdf = pdf_cosine_hemisphere(normal, incident);
-	if (almost_zero(pdf)) return Color();
+struct Keyframe
+{
+	float frame;
+	Vec3 position;
+};
 
-	make_same_side(outgoing, normal, incident);
-	float evaluated = 1.0f / Pi;
-	return Color(evaluated / pdf);
-}
+//Path of the mirror sphere in sequences, which rises and falls back every 48 frames
+const Keyframe MirrorKeyframes[] = { { 0.0f, { -2.5f, 2.0f, 1.5f } }, { 24.0f, { -2.5f, 6.0f, 1.5f } }, { 48.0f, { -2.5f, 2.0f, 1.5f } } };
 
-Color bsdf_specular_reflection(Vec3 outgoing, Vec3 normal, Vec3& incident)
+/**
+ * Linearly interpolates between the keyframes surrounding a frame, repeating the keyframes once past the last one.
+ */
+template<size_t Count>
+Vec3 interpolate_keyframes(const Keyframe (&keyframes)[Count], float frame)
 {
-	incident = reflect(outgoing, normal);
-	float correction = abs_dot(incident, normal);
-	if (almost_zero(correction)) return Color();
-	return Color(1.0f / correction);
+	frame = std::fmod(frame, keyframes[Count - 1].frame);
+
+	for (size_t i = 1; i < Count; ++i)
+	{
+		const Keyframe& previous = keyframes[i - 1];
+		const Keyframe& next = keyframes[i];
+		if (frame > next.frame) continue;
+
+		float weight = (frame - previous.frame) / (next.frame - previous.frame);
+		return previous.position * (1.0f - weight) + next.position * weight;
+	}
+
+	return keyframes[Count - 1].position;
 }
 
-Color bsdf_specular_fresnel(Vec3 outgoing, Vec3 normal, Vec3& incident, float eta)
+/**
+ * Makes the reference scene at a frame of its animation.
+ * @param furnished Whether to insert the spheres and slabs, otherwise only the room and its lights are inserted.
+ */
+Scene make_scene(uint32_t frame = 0, bool furnished = true)
 {
-	float cos_o = dot(outgoing, normal);
-	if (cos_o < 0.0f) eta = 1.0f / eta;
+	Scene scene;
 
-	float cos_i = fresnel_cos_i(eta, cos_o);
-	float evaluated = fresnel_value(eta, cos_o, cos_i);
+	//Cornell box interior scene
+	scene.insert_plane({ 0.0f, 1.0f, 0.0f }, 0.0f, 0);
+	scene.insert_plane({ 0.0f, 0.0f, -1.0f }, 5.0f, 3);
+	scene.insert_plane({ 1.0f, 0.0f, 0.0f }, 5.0f, 1);
+	scene.insert_plane({ 0.0f, -1.0f, 0.0f }, 10.0f, 0);
+	scene.insert_plane({ -1.0f, 0.0f, 0.0f }, 5.0f, 2);
 
-	//Uniform sampling
-	//	if (random_float() < 0.5f)
-	//	{
-	//		//Specular reflection
-	//		incident = normalize(reflect(outgoing, normal));
-	//	}
-	//	else
-	//	{
-	//		//Specular transmission
-	//		evaluated = 1.0f - evaluated;
-	//		incident = fresnel_refract(eta, cos_i, outgoing, normal);
-	//	}
-	//
-	//	float correction = abs_dot(incident, normal);
-	//	if (almost_zero(correction)) return Color();
-	//	return Color(evaluated / correction / 0.5f);
+	if (furnished)
+	{
+		scene.insert_sphere(interpolate_keyframes(MirrorKeyframes, static_cast<float>(frame)), 2.0f, 4);
+		scene.insert_sphere({ 2.0f, 2.0f, -2.5f }, 2.0f, 5);
+		scene.insert_box({ 0.0f, 8.75f, 0.0f }, { 6.0f, 0.1f, 6.0f }, 5);
+		scene.insert_box({ 0.0f, 8.25f, 0.0f }, { 6.0f, 0.1f, 6.0f }, 5);
+		scene.insert_box({ 0.0f, 7.75f, 0.0f }, { 6.0f, 0.1f, 6.0f }, 5);
+		scene.insert_box({ 0.0f, 7.25f, 0.0f }, { 6.0f, 0.1f, 6.0f }, 5);
+		scene.insert_box({ 0.0f, 6.75f, 0.0f }, { 6.0f, 0.1f, 6.0f }, 5);
+		scene.insert_box({ 0.0f, 6.25f, 0.0f }, { 6.0f, 0.1f, 6.0f }, 5);
+		scene.insert_box({ 0.0f, 5.75f, 0.0f }, { 6.0f, 0.1f, 6.0f }, 5);
+		scene.insert_box({ 0.0f, 5.25f, 0.0f }, { 6.0f, 0.1f, 6.0f }, 5);
+		scene.insert_box({ 0.0f, 4.75f, 0.0f }, { 6.0f, 0.1f, 6.0f }, 5);
+	}
 
-	//Importance sampling
-	if (random_float() < evaluated) incident = normalize(reflect(outgoing, normal));
-	else incident = fresnel_refract(eta, cos_i, outgoing, normal);
+	//	scene.insert_box({ 0.0f, 9.5f, 0.0f }, { 6.0f, 0.2f, 6.0f }, 10);
+	scene.insert_box({ -2.05f, 9.5f, 0.0f }, { 1.9f, 0.2f, 6.0f }, 11);
+	scene.insert_box({ 0.0f, 9.5f, 0.0f }, { 1.9f, 0.2f, 6.0f }, 12);
+	scene.insert_box({ 2.05f, 9.5f, 0.0f }, { 1.9f, 0.2f, 6.0f }, 13);
 
-	float correction = abs_dot(incident, normal);
-	if (almost_zero(correction)) return Color();
-	return Color(1.0f / correction);
+	return scene;
 }
 
 Color bsdf(uint32_t material, Vec3 outgoing, Vec3 normal, Vec3& incident)
@@ -118,6 +141,23 @@ Color bsdf(uint32_t material, Vec3 outgoing, Vec3 normal, Vec3& incident)
 	return Color();
 }
 
+/**
+ * Returns the name of the BSDF function that bsdf calls for a material.
+ */
+const char* bsdf_function(uint32_t material)
+{
+	switch (material)
+	{
+		case 0:
+		case 1:
+		case 2:
+		case 3: return "bsdf_lambertian_reflection";
+		case 4: return "bsdf_specular_reflection";
+		case 5: return "bsdf_specular_fresnel";
+		default: return "bsdf";
+	}
+}
+
 Color emit(uint32_t material)
 {
 	switch (material)
@@ -137,7 +177,7 @@ Color escape(Vec3 direction)
 	return direction * direction;
 }
 
-Color evaluate(const Ray& ray, uint32_t depth)
+Color evaluate(const Scene& scene, const Ray& ray, uint32_t depth)
 {
 	if (depth == 0) return escape(ray.direction);
 
@@ -145,7 +185,7 @@ Color evaluate(const Ray& ray, uint32_t depth)
 	Vec3 normal;
 	uint32_t material;
 
-	if (not Scene.intersect(ray, distance, normal, material)) return escape(ray.direction);
+	if (not scene.intersect(ray, distance, normal, material)) return escape(ray.direction);
 
 	Vec3 outgoing = -ray.direction;
 	Vec3 incident;
@@ -155,22 +195,119 @@ Color evaluate(const Ray& ray, uint32_t depth)
 
 	Ray new_ray = bounce(ray, distance, incident);
 	float lambertian = abs_dot(normal, incident);
-	return emission + scatter * evaluate(new_ray, depth - 1) * lambertian;
+	return emission + scatter * evaluate(scene, new_ray, depth - 1) * lambertian;
 }
 
-Color evaluate_iterative(Ray ray, uint32_t depth)
+/**
+ * Collects the primitives intersected by paths within a number of bounces.
+ * A depth of one only records primary hits, larger depths also catch indirect effects but
+ * in a closed scene every path eventually sees almost every primitive.
+ */
+struct PathRecord
+{
+	uint32_t depth = 1;
+	ArenaVector<PrimitiveID> primitives; //Possibly repeated until compacted, allocated from the arena of the thread
+	uint64_t rays = 0; //The number of rays traced by the paths
+
+	//When diagnosing, where the first non-finite value of the last path appeared
+	bool diagnose = false;
+	const char* invalid_function = nullptr;
+	uint32_t invalid_depth = 0;
+	uint32_t invalid_material = 0;
+
+	/**
+	 * Adds a primitive, removing the repeated ones instead of growing whenever the primitives are full.
+	 */
+	void insert(PrimitiveID primitive)
+	{
+		if (primitives.size() == primitives.capacity())
+		{
+			compact();
+			if (primitives.size() * 2 >= primitives.capacity()) primitives.reserve(std::max(primitives.capacity() * 2, size_t(64)));
+		}
+
+		primitives.push_back(primitive);
+	}
+
+	/**
+	 * Sorts the primitives and removes the repeated ones.
+	 */
+	void compact()
+	{
+		std::sort(primitives.begin(), primitives.end());
+		primitives.erase(std::unique(primitives.begin(), primitives.end()), primitives.end());
+	}
+};
+
+constexpr uint32_t NoMaterial = ~0U;
+
+/**
+ * A sample dropped because it was not finite, and where its first non-finite value appeared.
+ */
+struct InvalidSample
+{
+	uint32_t x = 0;
+	uint32_t y = 0;
+	uint32_t depth = 0;
+	uint32_t material = NoMaterial;
+	const char* function = nullptr;
+};
+
+/**
+ * The invalid samples found by all threads while diagnosing, which are rare enough to be collected under a lock.
+ */
+struct InvalidSamples
+{
+	std::mutex mutex;
+	std::vector<InvalidSample> samples;
+	std::atomic<uint64_t> total = 0; //The number of samples rendered while diagnosing
+};
+
+InvalidSamples invalid_samples;
+
+/**
+ * Evaluates the radiance arriving along a ray.
+ * @param record If not null, the primitives intersected along the path are inserted into it and its rays counted.
+ * If it is diagnosing, also outputs the function, depth and material where the first non-finite value appeared.
+ */
+Color evaluate_iterative(const Scene& scene, Ray ray, uint32_t depth, PathRecord* record)
 {
 	Color energy(1.0f);
 	Color result(0.0f);
+	uint32_t i = 0;
+
+	bool diagnose = record != nullptr && record->diagnose;
+	if (diagnose) record->invalid_function = nullptr;
+
+	auto check = [&](bool invalid, const char* function, uint32_t material)
+	{
+		if (not invalid || record->invalid_function != nullptr) return;
+		record->invalid_function = function;
+		record->invalid_depth = i + 1;
+		record->invalid_material = material;
+	};
+
+	if (diagnose) check(is_invalid(ray.direction), "render_sample", NoMaterial);
 
-	for (uint32_t i = 0; i < depth; ++i)
+	for (; i < depth; ++i)
 	{
 		float distance;
 		Vec3 normal;
 		uint32_t material;
+		PrimitiveID primitive;
 
-		if (not Scene.intersect(ray, distance, normal, material)) break;
+		bool hit;
 
+		{
+			PerfScope scope(PerfRegion::Intersection);
+			hit = scene.intersect(ray, distance, normal, material, primitive);
+		}
+
+		if (not hit) break;
+		if (record != nullptr && i < record->depth) record->insert(primitive);
+		if (diagnose) check(not std::isfinite(distance) || is_invalid(normal), "Scene::intersect", material);
+
+		PerfScope scope(PerfRegion::Shading);
 		Vec3 outgoing = -ray.direction;
 		Vec3 incident;
 
@@ -183,58 +320,2088 @@ Color evaluate_iterative(Ray ray, uint32_t depth)
 		result = result + emission * energy;
 		energy = energy * scatter * lambertian;
 
+		if (diagnose)
+		{
+			check(is_invalid(scatter) || is_invalid(incident), bsdf_function(material), material);
+			check(is_invalid(emission), "emit", material);
+			check(is_invalid(ray.origin), "bounce", material);
+			check(is_invalid(energy) || is_invalid(result), "evaluate_iterative", material);
+		}
+
 		if (almost_black(energy)) break;
 	}
 
+	STATISTIC(add_path(std::min(i + 1, depth)));
+	if (record != nullptr) record->rays += std::min(i + 1, depth);
 	if (almost_black(energy)) return result;
-	return result + energy * escape(ray.direction);
+
+	Color escaped = escape(ray.direction);
+	if (diagnose) check(is_invalid(escaped), "escape", NoMaterial);
+	return result + energy * escaped;
 }
 
-Color render_sample(float u, float v)
+Color render_sample(const Scene& scene, float u, float v, PathRecord* record)
 {
 	Ray ray;
+	ray.origin = CameraOrigin;
+	ray.direction = normalize(Vec3(u, v, CameraFocal));
+	return evaluate_iterative(scene, ray, MaxBounces, record);
+}
 
-	//Cornell box interior scene
-	ray.origin = Vec3(0.0f, 5.0f, -20.0f);
-	ray.direction = normalize(Vec3(u, v, 1.5f));
+/**
+ * Finds the pixels a box can directly appear on, which is the inverse of the camera in render_sample.
+ * @return Whether the box is entirely in front of the camera. If not, the region is not useful.
+ */
+bool project_bounds(Vec3 min, Vec3 max, uint32_t width, uint32_t height, Region& region)
+{
+	float min_x = Infinity;
+	float min_y = Infinity;
+	float max_x = -Infinity;
+	float max_y = -Infinity;
+
+	for (uint32_t i = 0; i < 8; ++i)
+	{
+		Vec3 corner(i & 1 ? max.x : min.x, i & 2 ? max.y : min.y, i & 4 ? max.z : min.z);
+		Vec3 offset = corner - CameraOrigin;
+		if (offset.z <= 0.0f) return false;
+
+		float u = offset.x / offset.z * CameraFocal;
+		float v = offset.y / offset.z * CameraFocal;
+		float x = u * width + width / 2.0f;
+		float y = v * width + height / 2.0f;
+
+		min_x = std::min(min_x, x);
+		min_y = std::min(min_y, y);
+		max_x = std::max(max_x, x);
+		max_y = std::max(max_y, y);
+	}
 
-	return evaluate_iterative(ray, MaxBounces);
+	//One extra pixel on every side covers the jittering of the samples
+	auto clamp = [](float value, uint32_t limit) { return static_cast<uint32_t>(std::clamp(value, 0.0f, static_cast<float>(limit))); };
+	region.x = clamp(std::floor(min_x) - 1.0f, width);
+	region.y = clamp(std::floor(min_y) - 1.0f, height);
+	region.width = clamp(std::ceil(max_x) + 1.0f, width) - region.x;
+	region.height = clamp(std::ceil(max_y) + 1.0f, height) - region.y;
+	return true;
 }
 
-Color render_pixel(uint32_t x, uint32_t y)
+/**
+ * Renders a number of samples for a pixel and adds the valid ones to a film.
+ * @param record If not null, the primitives intersected by the paths are inserted into it.
+ */
+void render_pixel(const Scene& scene, Film& film, uint32_t x, uint32_t y, uint32_t samples, PathRecord* record = nullptr)
 {
-	Color result;
-	uint32_t count = 0;
+	float width = static_cast<float>(film.get_width());
+	float height = static_cast<float>(film.get_height());
 
-	for (uint32_t i = 0; i < SamplesPerPixel; ++i)
+	if (record != nullptr && record->diagnose) invalid_samples.total.fetch_add(samples, std::memory_order_relaxed);
+
+	for (uint32_t i = 0; i < samples; ++i)
 	{
-		float u = (static_cast<float>(x) + random_float() - ImageWidth / 2.0f) / ImageWidth;
-		float v = (static_cast<float>(y) + random_float() - ImageHeight / 2.0f) / ImageWidth;
+		float u;
+		float v;
 
-		Color sample = render_sample(u, v);
-		if (is_invalid(sample)) continue;
-		result = result + sample;
-		++count;
+		{
+			PerfScope scope(PerfRegion::Sampling);
+			u = (static_cast<float>(x) + random_float() - width / 2.0f) / width;
+			v = (static_cast<float>(y) + random_float() - height / 2.0f) / width;
+		}
+
+		Color sample = render_sample(scene, u, v, record);
+
+		if (is_invalid(sample))
+		{
+			STATISTIC(invalid_samples += 1);
+			if (record == nullptr || not record->diagnose) continue;
+
+			InvalidSample invalid{ x, y, record->invalid_depth, record->invalid_material, record->invalid_function };
+			if (invalid.function == nullptr) invalid.function = "unknown";
+
+			std::lock_guard lock(invalid_samples.mutex);
+			invalid_samples.samples.push_back(invalid);
+			continue;
+		}
+
+		film.add_sample(x, y, sample);
+	}
+}
+
+/**
+ * Returns whether a pixel is the top left corner of a stride by stride block.
+ * Preview passes take their samples at these pixels.
+ */
+bool is_preview_pixel(uint32_t x, uint32_t y, uint32_t stride) { return x % stride == 0 && y % stride == 0; }
+
+/**
+ * Returns the number of samples a pixel has already received from the preview passes.
+ * Because every stride is a multiple of the next one, a pixel is sampled by at most one pass.
+ */
+uint32_t preview_samples(uint32_t x, uint32_t y, uint32_t samples)
+{
+	uint32_t finest = std::end(PreviewStrides)[-1];
+	return std::min(is_preview_pixel(x, y, finest) ? 1U : 0U, samples);
+}
+
+/**
+ * A path in flight in the wavefront mode, packed into 32 bytes so that large batches of paths stream through the caches.
+ * Instead of the state of a random generator, the random sequence of every bounce is seeded from the pixel, the sample and the depth.
+ */
+struct PathState
+{
+	Vec3 origin;
+	uint32_t direction;     //See encode_octahedral
+	uint16_t throughput[3]; //See encode_half
+	uint16_t depth;         //The number of bounces so far
+	uint32_t pixel;         //The index of the pixel in its tile
+	uint32_t sample;        //The index of the sample in its pixel, the counter of the random sequence
+};
+
+static_assert(sizeof(PathState) == 32);
+
+/**
+ * Derives the seed of the random sequence used by a bounce of a path.
+ */
+uint32_t path_seed(uint32_t x, uint32_t y, uint32_t sample, uint32_t depth)
+{
+	uint32_t hash = x * 0x9E3779B1U ^ y * 0x85EBCA77U ^ sample * 0xC2B2AE3DU ^ depth * 0x27D4EB2FU;
+	hash ^= hash >> 16;
+	hash *= 0x7FEB352DU;
+	hash ^= hash >> 15;
+	hash *= 0x846CA68BU;
+	return hash ^ hash >> 16;
+}
+
+/**
+ * Intersects the rays of all paths with the scene, either a Scene or a SharedScene.
+ */
+template<class Geometry>
+void intersect_paths(const Geometry& scene, const ArenaVector<PathState>& paths, ArenaVector<RayHit>& hits)
+{
+	hits.resize(paths.size());
+
+	for (size_t i = 0; i < paths.size(); ++i)
+	{
+		const PathState& path = paths[i];
+		RayHit& hit = hits[i];
+
+		PerfScope scope(PerfRegion::Intersection);
+		scene.intersect(Ray(path.origin, decode_octahedral(path.direction)), hit.distance, hit.normal, hit.material);
+	}
+}
+
+/**
+ * Intersects the rays of all paths with the chunks of an out-of-core scene as one batch.
+ */
+void intersect_paths(OutOfCoreScene& scene, const ArenaVector<PathState>& paths, ArenaVector<RayHit>& hits)
+{
+	hits.resize(paths.size());
+
+	ArenaScope scope(get_thread_arena());
+	ArenaVector<Ray> rays;
+	rays.reserve(paths.size());
+	for (const PathState& path : paths) rays.emplace_back(path.origin, decode_octahedral(path.direction));
+
+	scene.intersect(rays.data(), rays.size(), hits.data());
+}
+
+/**
+ * Runs an action over a range split into blocks, either on the calling thread as one block or on all threads.
+ * @param action Called with the begin and end of every block.
+ */
+template<class Action>
+void for_blocks(size_t count, bool parallel, const Action& action)
+{
+	if (not parallel) return action(size_t(0), count);
+
+	auto blocks = static_cast<uint32_t>((count + OutOfCoreBlock - 1) / OutOfCoreBlock);
+	parallel_for(0, blocks, [&](uint32_t block)
+	{
+		size_t begin = size_t(block) * OutOfCoreBlock;
+		action(begin, std::min(begin + OutOfCoreBlock, count));
+	});
+}
+
+/**
+ * Scatters a path at its hit and adds the light it gathers to its slot of the radiance.
+ * @return Whether the path continues.
+ */
+bool shade_path(const Region& tile, PathState& path, const RayHit& hit, ArenaVector<Color>& radiance, uint32_t first_sample, uint32_t wave_samples)
+{
+	PerfScope scope(PerfRegion::Shading);
+	Ray ray(path.origin, decode_octahedral(path.direction));
+	Color energy(decode_half(path.throughput[0]), decode_half(path.throughput[1]), decode_half(path.throughput[2]));
+	Color& result = radiance[path.pixel * wave_samples + path.sample - first_sample];
+
+	if (hit.distance == Infinity)
+	{
+		STATISTIC(add_path(path.depth + 1U));
+		result = result + energy * escape(ray.direction);
+		return false;
+	}
+
+	uint32_t x = tile.x + path.pixel % tile.width;
+	uint32_t y = tile.y + path.pixel / tile.width;
+	seed_random(path_seed(x, y, path.sample, path.depth + 1U));
+
+	Vec3 outgoing = -ray.direction;
+	Vec3 incident;
+
+	Color scatter = bsdf(hit.material, outgoing, hit.normal, incident);
+	Color emission = emit(hit.material);
+
+	ray = bounce(ray, hit.distance, incident);
+	float lambertian = abs_dot(hit.normal, incident);
+
+	result = result + emission * energy;
+	energy = energy * scatter * lambertian;
+	++path.depth;
+
+	if (almost_black(energy) || is_invalid(incident))
+	{
+		STATISTIC(add_path(path.depth));
+		if (is_invalid(incident)) result = Color(std::numeric_limits<float>::quiet_NaN());
+		return false;
+	}
+
+	if (path.depth == MaxBounces)
+	{
+		STATISTIC(add_path(path.depth));
+		result = result + energy * escape(ray.direction);
+		return false;
+	}
+
+	path.origin = ray.origin;
+	path.direction = encode_octahedral(ray.direction);
+	path.throughput[0] = encode_half(energy.x);
+	path.throughput[1] = encode_half(energy.y);
+	path.throughput[2] = encode_half(energy.z);
+	return true;
+}
+
+/**
+ * Shades every path, see shade_path, and removes the finished paths while keeping the order of the others.
+ * Every path only writes its own slot of the radiance, so the paths can be shaded in parallel.
+ * @param radiance The sums of the samples of the wave, at the pixel times wave_samples plus the sample minus first_sample.
+ * @param parallel Whether to shade on all threads, for a wave shared by the threads instead of one per thread.
+ */
+void shade_paths(const Region& tile, ArenaVector<PathState>& paths, const ArenaVector<RayHit>& hits, ArenaVector<Color>& radiance,
+                 uint32_t first_sample, uint32_t wave_samples, bool parallel = false)
+{
+	//A finished path is marked by a depth past the last bounce
+	for_blocks(paths.size(), parallel, [&](size_t begin, size_t end)
+	{
+		for (size_t i = begin; i < end; ++i)
+		{
+			if (not shade_path(tile, paths[i], hits[i], radiance, first_sample, wave_samples)) paths[i].depth = MaxBounces + 1;
+		}
+	});
+
+	size_t remaining = 0;
+
+	for (size_t i = 0; i < paths.size(); ++i)
+	{
+		if (paths[i].depth <= MaxBounces) paths[remaining++] = paths[i];
+	}
+
+	paths.resize(remaining);
+}
+
+/**
+ * Renders a tile breadth first: the samples of all its pixels are traced together one bounce at a time,
+ * in waves of up to a number of paths kept in the arena of the thread.
+ * @param scene A Scene, SharedScene or OutOfCoreScene, see intersect_paths.
+ * @param parallel Whether the paths of a wave are generated, shaded and accumulated on all threads, for a single tile
+ * covering the whole image. The result is the same either way, since every path seeds its own random sequences.
+ * @return The number of rays traced.
+ */
+template<class Geometry>
+uint64_t render_tile_wavefront(Geometry& scene, Film& film, const Region& tile, uint32_t samples, bool previewed,
+                               uint32_t wave_paths = WavefrontPaths, bool parallel = false)
+{
+	ArenaScope scope(get_thread_arena());
+	uint32_t pixels = tile.width * tile.height;
+	uint32_t wave_samples = std::clamp(wave_paths / pixels, 1U, samples);
+
+	ArenaVector<PathState> paths;
+	ArenaVector<RayHit> hits;
+	ArenaVector<Color> radiance;
+	ArenaVector<uint32_t> offsets(pixels + 1); //Where the paths of every pixel start in a wave
+	paths.reserve(pixels * wave_samples);
+	hits.reserve(pixels * wave_samples);
+
+	float width = static_cast<float>(film.get_width());
+	float height = static_cast<float>(film.get_height());
+	uint64_t rays = 0;
+
+	for (uint32_t first = 0; first < samples; first += wave_samples)
+	{
+		uint32_t last = std::min(first + wave_samples, samples);
+		radiance.assign(pixels * wave_samples, Color());
+
+		//The samples of a pixel in this wave that were not taken by the previews
+		auto sample_range = [&](uint32_t x, uint32_t y)
+		{
+			uint32_t taken = previewed ? preview_samples(x, y, samples) : 0;
+			return std::pair(std::min(std::max(first, taken), last), last);
+		};
+
+		for (uint32_t pixel = 0; pixel < pixels; ++pixel)
+		{
+			auto [begin, end] = sample_range(tile.x + pixel % tile.width, tile.y + pixel / tile.width);
+			offsets[pixel + 1] = offsets[pixel] + end - begin;
+		}
+
+		paths.resize(offsets[pixels]);
+
+		for_blocks(pixels, parallel, [&](size_t block_begin, size_t block_end)
+		{
+			for (auto pixel = static_cast<uint32_t>(block_begin); pixel < block_end; ++pixel)
+			{
+				uint32_t x = tile.x + pixel % tile.width;
+				uint32_t y = tile.y + pixel / tile.width;
+				auto [begin, end] = sample_range(x, y);
+
+				for (uint32_t sample = begin; sample < end; ++sample)
+				{
+					PerfScope scope(PerfRegion::Sampling);
+					seed_random(path_seed(x, y, sample, 0));
+					float u = (static_cast<float>(x) + random_float() - width / 2.0f) / width;
+					float v = (static_cast<float>(y) + random_float() - height / 2.0f) / width;
+
+					PathState& path = paths[offsets[pixel] + sample - begin];
+					path = { CameraOrigin, encode_octahedral(normalize(Vec3(u, v, CameraFocal))) };
+					std::fill(std::begin(path.throughput), std::end(path.throughput), encode_half(1.0f));
+					path.pixel = pixel;
+					path.sample = sample;
+				}
+			}
+		});
+
+		while (not paths.empty())
+		{
+			rays += paths.size();
+			intersect_paths(scene, paths, hits);
+			shade_paths(tile, paths, hits, radiance, first, wave_samples, parallel);
+		}
+
+		for_blocks(pixels, parallel, [&](size_t block_begin, size_t block_end)
+		{
+			for (auto pixel = static_cast<uint32_t>(block_begin); pixel < block_end; ++pixel)
+			{
+				uint32_t x = tile.x + pixel % tile.width;
+				uint32_t y = tile.y + pixel / tile.width;
+				auto [begin, end] = sample_range(x, y);
+
+				for (uint32_t sample = begin; sample < end; ++sample)
+				{
+					Color color = radiance[pixel * wave_samples + sample - first];
+
+					if (is_invalid(color))
+					{
+						STATISTIC(invalid_samples += 1);
+						continue;
+					}
+
+					film.add_sample(x, y, color);
+				}
+			}
+		});
+	}
+
+	return rays;
+}
+
+/**
+ * Renders one sample for every preview pixel of a stride that was not sampled by a coarser pass.
+ * @param window The region of the film to render.
+ * @param coarser The stride of the previous pass, or zero if this is the first pass.
+ * @param diagnose Whether to collect the invalid samples, see InvalidSamples.
+ */
+void render_preview(const Scene& scene, Film& film, const Region& window, uint32_t stride, uint32_t coarser, bool diagnose = false)
+{
+	uint32_t begin = (window.y + stride - 1) / stride;
+	uint32_t end = (window.y + window.height + stride - 1) / stride;
+
+	parallel_for(begin, end, [&](uint32_t row)
+	{
+		TraceSpan span("preview");
+		uint32_t y = row * stride;
+		uint32_t x = (window.x + stride - 1) / stride * stride;
+
+		PathRecord record{ 0 };
+		record.diagnose = diagnose;
+
+		for (; x < window.x + window.width; x += stride)
+		{
+			if (coarser != 0 && is_preview_pixel(x, y, coarser)) continue;
+			render_pixel(scene, film, x, y, 1, diagnose ? &record : nullptr);
+		}
+	});
+}
+
+/**
+ * A change made to a primitive of the scene.
+ */
+struct Edit
+{
+	PrimitiveID primitive = 0;
+	std::optional<uint32_t> material;
+	Vec3 offset;
+};
+
+void apply_edits(Scene& scene, const std::vector<Edit>& edits)
+{
+	for (const Edit& edit : edits)
+	{
+		if (edit.material) scene.set_material(edit.primitive, *edit.material);
+		scene.translate(edit.primitive, edit.offset);
 	}
+}
 
-	return result / static_cast<float>(count);
+/**
+ * Returns the settings that fill the room of the reference scene with generated primitives using its materials.
+ */
+ProceduralSettings make_procedural_settings(ProceduralKind kind, uint32_t count, uint32_t seed)
+{
+	ProceduralSettings settings;
+	settings.kind = kind;
+	settings.count = count;
+	settings.seed = seed;
+	settings.materials = { 0, 1, 2, 3, 4, 5 };
+	settings.emitters = { 10, 11, 12, 13 };
+	return settings;
 }
 
-int main()
+/**
+ * The primitives seen by the paths of every rendered tile.
+ * These are used to find the tiles that need to be rendered again after an Edit.
+ */
+struct TileRecords
+{
+	uint32_t width = 0;
+	uint32_t height = 0;
+	std::vector<Region> tiles;
+	std::vector<std::vector<PrimitiveID>> primitives;
+};
+
+struct Options
+{
+	uint32_t width = ImageWidth;
+	uint32_t height = ImageHeight;
+	uint32_t samples = SamplesPerPixel;
+
+	std::optional<Region> crop;
+	std::vector<Region> priorities;
+
+	std::string output = "output.png";
+	std::string float_output;
+	std::string composite;
+
+	std::vector<Edit> edits;
+	std::string records;
+	uint32_t record_depth = 1;
+	std::string update_image;
+	std::string update_records;
+
+	std::optional<std::pair<uint32_t, uint32_t>> frames;
+
+	std::string converge_reference;
+	std::vector<double> checkpoints = { 1.0, 2.0, 4.0, 8.0, 16.0, 32.0 };
+	std::string curve = "convergence.csv";
+	std::vector<std::string> compare;
+	std::string heatmap;
+	std::string invalid_report;
+	std::string trace;
+	bool perf = false;
+
+	std::optional<ProceduralSettings> procedural;
+	BVHSettings bvh;
+	HugePages huge_pages = HugePages::Off;
+
+	uint32_t node = 0;
+	uint32_t nodes = 1;
+	std::string balance_costs;
+	std::string run; //Tells the files of repeated runs of the same sequence apart
+
+	uint32_t threads = 0;
+	uint32_t tile_size = TileSize;
+	uint32_t grain = 1;
+	bool wavefront = false;
+
+	std::string write_chunks;
+	uint32_t chunk_primitives = 0;
+	std::string out_of_core;
+	size_t chunk_budget = 0;
+	std::string particles;
+	std::string write_particles;
+	std::string share_scene;
+	std::string unshare_scene;
+	std::string shared_scene;
+	bool tune = false;
+	std::string tune_cache = "tuning.cache";
+
+	uint32_t scaling_samples = 0;
+	bool check_allocations = false;
+	std::string scaling_output = "scaling.csv";
+};
+
+/**
+ * Renders the tiles in order. Tiles overlapping a priority region receive PrioritySampleScale times as many samples.
+ * @param previewed Whether the preview passes were rendered, whose samples are then not rendered again.
+ * @param records If not null, outputs the primitives seen by the paths of every tile.
+ * @param costs If not null, outputs the cycles spent on every pixel of the film. In the wavefront mode,
+ * the pixels of a tile share its cycles evenly.
+ * @param rays If not null, outputs the number of rays traced by every tile.
+ */
+void render_tiles(const Scene& scene, Film& film, const Options& options, const std::vector<Region>& tiles, bool previewed,
+                  TileRecords* records = nullptr, std::vector<float>* costs = nullptr, std::vector<uint64_t>* rays = nullptr)
 {
-	std::vector<Color> colors(ImageWidth * ImageHeight);
+	if (costs != nullptr) costs->assign(film.get_width() * film.get_height(), 0.0f);
+	if (rays != nullptr) rays->assign(tiles.size(), 0);
+
+	if (records != nullptr)
+	{
+		records->width = film.get_width();
+		records->height = film.get_height();
+		records->tiles = tiles;
+		records->primitives.assign(tiles.size(), {});
+	}
 
-	parallel_for(0, ImageHeight, [&](uint32_t y)
+	parallel_for(0, tiles.size(), [&](uint32_t index)
 	{
-		for (uint32_t x = 0; x < ImageWidth; ++x)
+		TraceSpan span("tile");
+		ArenaScope scope(get_thread_arena());
+		const Region& tile = tiles[index];
+		PathRecord record{ records == nullptr ? 0 : options.record_depth };
+		record.diagnose = not options.invalid_report.empty();
+		PathRecord* record_pointer = records == nullptr && rays == nullptr && not record.diagnose ? nullptr : &record;
+		uint32_t samples = options.samples;
+
+		for (const Region& priority : options.priorities)
+		{
+			if (not tile.overlaps(priority)) continue;
+			samples *= PrioritySampleScale;
+			break;
+		}
+
+		if (options.wavefront)
+		{
+			uint64_t start = costs == nullptr ? 0 : read_cycle_counter();
+			uint64_t traced = render_tile_wavefront(scene, film, tile, samples, previewed);
+			if (rays != nullptr) (*rays)[index] = traced;
+			if (costs == nullptr) return;
+
+			//The samples of all pixels are traced together, so the cycles of the tile are spread evenly over its pixels
+			float cost = static_cast<float>(read_cycle_counter() - start) / static_cast<float>(tile.width * tile.height);
+
+			for (uint32_t y = tile.y; y < tile.y + tile.height; ++y)
+			{
+				std::fill_n(costs->begin() + y * film.get_width() + tile.x, tile.width, cost);
+			}
+
+			return;
+		}
+
+		for (uint32_t y = tile.y; y < tile.y + tile.height; ++y)
 		{
-			Color color = render_pixel(x, y);
-			size_t index = y * ImageWidth + x;
-			colors[index] = color;
+			for (uint32_t x = tile.x; x < tile.x + tile.width; ++x)
+			{
+				uint32_t taken = previewed ? preview_samples(x, y, samples) : 0;
+				uint64_t start = costs == nullptr ? 0 : read_cycle_counter();
+				render_pixel(scene, film, x, y, samples - taken, record_pointer);
+
+				if (costs == nullptr) continue;
+				(*costs)[y * film.get_width() + x] = static_cast<float>(read_cycle_counter() - start);
+			}
 		}
+
+		if (rays != nullptr) (*rays)[index] = record.rays;
+		if (records == nullptr) return;
+		record.compact();
+		records->primitives[index].assign(record.primitives.begin(), record.primitives.end());
 	});
+}
+
+void write_records(const std::string& filename, const TileRecords& records)
+{
+	std::ofstream stream(filename);
+	stream << records.width << ' ' << records.height << ' ' << records.tiles.size() << '\n';
+
+	for (size_t i = 0; i < records.tiles.size(); ++i)
+	{
+		const Region& tile = records.tiles[i];
+		stream << tile.x << ' ' << tile.y << ' ' << tile.width << ' ' << tile.height << ' ' << records.primitives[i].size();
+		for (PrimitiveID primitive : records.primitives[i]) stream << ' ' << primitive;
+		stream << '\n';
+	}
+
+	if (not stream) throw std::runtime_error("Error in when outputting records.");
+}
+
+TileRecords read_records(const std::string& filename)
+{
+	std::ifstream stream(filename);
+	TileRecords records;
+	size_t count;
+
+	stream >> records.width >> records.height >> count;
+	records.tiles.resize(count);
+	records.primitives.resize(count);
+
+	for (size_t i = 0; i < count; ++i)
+	{
+		Region& tile = records.tiles[i];
+		size_t primitive_count;
+		stream >> tile.x >> tile.y >> tile.width >> tile.height >> primitive_count;
+
+		records.primitives[i].resize(primitive_count);
+		for (PrimitiveID& primitive : records.primitives[i]) stream >> primitive;
+	}
+
+	if (not stream) throw std::runtime_error("Error in when reading records: " + filename);
+	return records;
+}
+
+/**
+ * Finds the indices of the tiles whose pixels might change because of the edits.
+ * A tile is dirty if one of its recorded paths saw an edited primitive, or if the new bounds of an edited
+ * primitive project onto it (where the primitive might now be directly visible). Effects beyond the
+ * recorded depth, or indirect effects at the new location, are not caught.
+ */
+std::vector<size_t> find_dirty_tiles(const Scene& edited, const TileRecords& records, const std::vector<Edit>& edits)
+{
+	std::vector<bool> dirty(records.tiles.size());
+
+	for (const Edit& edit : edits)
+	{
+		Vec3 min;
+		Vec3 max;
+		Region projected;
+		bool bounded = edited.get_bounds(edit.primitive, min, max);
+		bool visible = bounded && project_bounds(min, max, records.width, records.height, projected);
+
+		for (size_t i = 0; i < records.tiles.size(); ++i)
+		{
+			const std::vector<PrimitiveID>& primitives = records.primitives[i];
+			if (std::binary_search(primitives.begin(), primitives.end(), edit.primitive)) dirty[i] = true;
+
+			//Moving an unbounded primitive or one crossing the camera plane can affect every pixel
+			if (edit.offset.x != 0.0f || edit.offset.y != 0.0f || edit.offset.z != 0.0f)
+			{
+				if (not visible || records.tiles[i].overlaps(projected)) dirty[i] = true;
+			}
+		}
+	}
+
+	std::vector<size_t> result;
+	for (size_t i = 0; i < dirty.size(); ++i) if (dirty[i]) result.push_back(i);
+	return result;
+}
+
+/**
+ * Renders again only the tiles affected by the edits, and composites them into the previous image.
+ * The records of the rendered tiles are replaced so that further edits can be applied.
+ */
+void render_update(const Scene& scene, const Options& options)
+{
+	TileRecords records = read_records(options.update_records);
+
+	uint32_t width;
+	uint32_t height;
+	std::vector<Color> colors = read_float_image(options.update_image, width, height);
+	if (width != records.width || height != records.height) throw std::runtime_error("Records do not match image.");
+
+	std::vector<size_t> dirty = find_dirty_tiles(scene, records, options.edits);
+	std::cout << "Rendering " << dirty.size() << " of " << records.tiles.size() << " tiles." << std::endl;
+
+	std::vector<Region> tiles;
+	for (size_t index : dirty) tiles.push_back(records.tiles[index]);
+
+	Film film(width, height);
+	TileRecords rendered;
+
+	{
+		STATISTIC_STAGE("render");
+		render_tiles(scene, film, options, tiles, false, &rendered);
+	}
+
+	STATISTIC_STAGE("output");
+
+	for (size_t i = 0; i < dirty.size(); ++i)
+	{
+		const Region& tile = tiles[i];
+		records.primitives[dirty[i]] = std::move(rendered.primitives[i]);
+
+		for (uint32_t y = tile.y; y < tile.y + tile.height; ++y)
+		{
+			for (uint32_t x = tile.x; x < tile.x + tile.width; ++x) colors[y * width + x] = film.get_color(x, y);
+		}
+	}
+
+	write_image(options.output, width, height, colors.data());
+	if (not options.float_output.empty()) write_float_image(options.float_output, width, height, colors.data());
+	if (not options.records.empty()) write_records(options.records, records);
+}
+
+/**
+ * Returns the tiles of a window, the ones overlapping a priority region first.
+ */
+std::vector<Region> make_tiles(const Options& options, const Region& window)
+{
+	std::vector<Region> tiles = split_tiles(window, options.tile_size);
+
+	std::stable_partition(tiles.begin(), tiles.end(), [&](const Region& tile)
+	{
+		auto overlaps = [&](const Region& priority) { return tile.overlaps(priority); };
+		return std::any_of(options.priorities.begin(), options.priorities.end(), overlaps);
+	});
+
+	return tiles;
+}
+
+/**
+ * Writes the window of the resolved colors of a film, either as a cropped image or composited into the full float image.
+ * @param stride The stride the colors were resolved with, the float image is only written at full resolution.
+ */
+void write_colors(std::vector<Color> colors, uint32_t width, uint32_t height, const Options& options, const Region& window, uint32_t stride = 1)
+{
+	PerfScope scope(PerfRegion::Output);
+
+	if (not options.composite.empty())
+	{
+		uint32_t base_width;
+		uint32_t base_height;
+		std::vector<Color> base = read_float_image(options.composite, base_width, base_height);
+		if (base_width != width || base_height != height) throw std::runtime_error("Composite image size does not match.");
+
+		for (uint32_t y = window.y; y < window.y + window.height; ++y)
+		{
+			auto source = colors.begin() + y * width;
+			std::copy(source + window.x, source + window.x + window.width, base.begin() + y * width + window.x);
+		}
+
+		colors = std::move(base);
+	}
+	else if (options.crop)
+	{
+		std::vector<Color> cropped;
+		cropped.reserve(window.width * window.height);
+
+		for (uint32_t y = window.y; y < window.y + window.height; ++y)
+		{
+			auto source = colors.begin() + y * width;
+			cropped.insert(cropped.end(), source + window.x, source + window.x + window.width);
+		}
+
+		colors = std::move(cropped);
+		width = window.width;
+		height = window.height;
+	}
+
+	write_image(options.output, width, height, colors.data());
+	if (stride == 1 && not options.float_output.empty()) write_float_image(options.float_output, width, height, colors.data());
+}
+
+/**
+ * Writes the window of the film, see write_colors.
+ */
+void write_output(const Film& film, const Options& options, const Region& window, uint32_t stride = 1)
+{
+	write_colors(film.resolve(stride, window), film.get_width(), film.get_height(), options, window, stride);
+}
+
+/**
+ * Inserts a zero padded frame number before the extension of a filename.
+ */
+std::string frame_filename(const std::string& filename, uint32_t frame)
+{
+	if (filename.empty()) return filename;
+
+	std::string number = std::to_string(frame);
+	number.insert(0, number.size() < 4 ? 4 - number.size() : 0, '0');
+
+	size_t dot = filename.find_last_of('.');
+	if (dot == std::string::npos) return filename + "_" + number;
+	return filename.substr(0, dot) + "_" + number + filename.substr(dot);
+}
+
+/**
+ * Makes the scene of a frame with the edits applied: either the reference scene,
+ * or its empty room filled with generated primitives, and the particles of a particle file.
+ */
+Scene build_scene(const Options& options, uint32_t frame = 0)
+{
+	Scene scene = make_scene(frame, not options.procedural);
+	if (options.procedural) insert_procedural(scene, *options.procedural);
+	if (not options.particles.empty()) scene.read_particles(options.particles);
+	apply_edits(scene, options.edits);
+	scene.build_bvh(options.bvh);
+	return scene;
+}
+
+/**
+ * Removes a value from a pipeline queue, tracing the time spent waiting for it.
+ */
+template<class T>
+std::optional<T> wait_pop(BoundedQueue<T>& queue)
+{
+	TraceSpan span("wait");
+	return queue.pop();
+}
+
+/**
+ * Inserts a value into a pipeline queue, tracing the time spent waiting for space.
+ */
+template<class T>
+bool wait_push(BoundedQueue<T>& queue, T value)
+{
+	TraceSpan span("wait");
+	return queue.push(std::move(value));
+}
+
+/**
+ * Returns a stamp identifying a frame of a run of a sequence split across nodes, from the run, the scene of the frame
+ * and the options that decide the tiles. The files the nodes exchange start with it, so that files left over
+ * from another run or frame are never read.
+ */
+uint64_t frame_stamp(const Options& options, const Scene& scene, uint32_t frame)
+{
+	Region window = options.crop.value_or(Region{ 0, 0, options.width, options.height });
+	std::stringstream key;
+	key << options.run << ' ' << std::hex << scene.get_hash() << std::dec << ' ' << frame << ' ' << options.width << ' ' << options.height
+	    << ' ' << window.x << ' ' << window.y << ' ' << window.width << ' ' << window.height << ' ' << options.samples << ' '
+	    << options.tile_size << ' ' << options.nodes;
+
+	//FNV-1a, like Scene::get_hash, so every host computes the same stamp
+	uint64_t hash = 14695981039346656037ULL;
+	for (char character : key.str()) hash = (hash ^ static_cast<unsigned char>(character)) * 1099511628211ULL;
+	return hash;
+}
+
+/**
+ * Opens a file written by another node, waiting until it exists and starts with a stamp on its own line.
+ * @param start When the wait started, it fails BalanceTimeout seconds after.
+ */
+std::ifstream open_node_file(const std::string& filename, uint64_t stamp, std::chrono::steady_clock::time_point start)
+{
+	while (true)
+	{
+		std::ifstream stream(filename, std::ios::binary);
+		uint64_t value;
+		if (stream >> value && value == stamp && stream.get() == '\n') return stream;
+
+		if (std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() > BalanceTimeout)
+		{
+			throw std::runtime_error("Timed out waiting for " + filename);
+		}
+
+		std::this_thread::sleep_for(std::chrono::milliseconds(50));
+	}
+}
+
+/**
+ * Estimates the cost of every tile by the number of rays traced by a few samples of a sparse grid of its pixels.
+ * The random sequence of every tile is seeded by its index, so every node computes the same estimate.
+ */
+std::vector<double> estimate_tile_costs(const Scene& scene, const Options& options, const std::vector<Region>& tiles)
+{
+	std::vector<double> costs(tiles.size());
+	Film film(options.width, options.height);
+
+	parallel_for(0, tiles.size(), [&](uint32_t index)
+	{
+		const Region& tile = tiles[index];
+		PathRecord record{ 0 };
+		uint32_t pixels = 0;
+		seed_random(index);
+
+		for (uint32_t y = tile.y; y < tile.y + tile.height; y += PrePassStride)
+		{
+			for (uint32_t x = tile.x; x < tile.x + tile.width; x += PrePassStride)
+			{
+				render_pixel(scene, film, x, y, PrePassSamples, &record);
+				++pixels;
+			}
+		}
+
+		costs[index] = static_cast<double>(record.rays) * tile.width * tile.height / pixels;
+	});
+
+	return costs;
+}
+
+/**
+ * Returns the name of the file holding the tile costs measured by a node in a frame.
+ */
+std::string tile_costs_filename(const Options& options, uint32_t frame, uint32_t node)
+{
+	return frame_filename(options.balance_costs, frame) + '.' + std::to_string(node);
+}
+
+/**
+ * Writes the measured cost of the tiles rendered by this node, as the stamp of the frame followed by lines of tile index and cost.
+ * The file is renamed into place once complete, so the other nodes never read a partial file.
+ */
+void write_tile_costs(const std::string& filename, uint64_t stamp, const std::vector<size_t>& indices, const std::vector<double>& costs)
+{
+	std::string temporary = filename + ".tmp";
+
+	{
+		std::ofstream stream(temporary);
+		stream << stamp << '\n';
+		for (size_t index : indices) stream << index << ' ' << costs[index] << '\n';
+		if (not stream) throw std::runtime_error("Error in when outputting tile costs.");
+	}
+
+	if (std::rename(temporary.c_str(), filename.c_str()) != 0) throw std::runtime_error("Cannot rename " + temporary);
+}
+
+/**
+ * Reads the tile costs measured by every node in a frame, waiting for the nodes that did not finish it yet.
+ * Tiles no node measured receive the average cost.
+ * @param stamp The stamp of the frame, see frame_stamp.
+ */
+std::vector<double> read_tile_costs(const Options& options, uint32_t frame, uint64_t stamp, size_t tile_count)
+{
+	std::vector<double> costs(tile_count, -1.0);
+	auto start = std::chrono::steady_clock::now();
+	TraceSpan span("wait");
+
+	for (uint32_t node = 0; node < options.nodes; ++node)
+	{
+		std::string filename = tile_costs_filename(options, frame, node);
+		std::ifstream stream = open_node_file(filename, stamp, start);
+		size_t index;
+		double cost;
+
+		while (stream >> index >> cost)
+		{
+			if (index >= tile_count) throw std::runtime_error("Invalid tile in " + filename);
+			costs[index] = cost;
+		}
+	}
+
+	double sum = 0.0;
+	size_t count = 0;
+
+	for (double cost : costs)
+	{
+		if (cost < 0.0) continue;
+		sum += cost;
+		++count;
+	}
+
+	double average = count == 0 ? 1.0 : sum / count;
+	for (double& cost : costs) if (cost < 0.0) cost = average;
+	return costs;
+}
+
+/**
+ * Splits the tiles into consecutive runs of equal total cost and returns the indices of the run of a node.
+ * A tile belongs to the run containing the middle of its cost, so every tile is assigned to exactly one node.
+ */
+std::vector<size_t> assign_tiles(const std::vector<double>& costs, uint32_t nodes, uint32_t node)
+{
+	double total = std::accumulate(costs.begin(), costs.end(), 0.0);
+	double begin = total * node / nodes;
+	double end = total * (node + 1) / nodes;
+
+	std::vector<size_t> indices;
+	double prefix = 0.0;
+
+	for (size_t i = 0; i < costs.size(); ++i)
+	{
+		double middle = prefix + costs[i] / 2.0;
+		if (middle >= begin && (middle < end || node + 1 == nodes)) indices.push_back(i);
+		prefix += costs[i];
+	}
+
+	return indices;
+}
+
+/**
+ * Returns the name of the file holding the tiles of a frame rendered by a node other than the first.
+ */
+std::string part_filename(const Options& options, uint32_t frame, uint32_t node)
+{
+	return frame_filename(options.output, frame) + ".node" + std::to_string(node);
+}
+
+/**
+ * Writes the colors of the tiles rendered by this node for the first node to merge, as the stamp of the frame on its own line
+ * followed by the index and the rows of colors of every tile. Like the costs, the file is renamed into place once complete.
+ */
+void write_part(const std::string& filename, uint64_t stamp, const std::vector<Region>& tiles, const std::vector<size_t>& indices,
+                const std::vector<Color>& colors, uint32_t width)
+{
+	std::string temporary = filename + ".tmp";
+
+	{
+		std::ofstream stream(temporary, std::ios::binary);
+		stream << stamp << '\n';
+
+		for (size_t index : indices)
+		{
+			const Region& tile = tiles[index];
+			uint64_t value = index;
+			stream.write(reinterpret_cast<const char*>(&value), sizeof(value));
+
+			for (uint32_t y = tile.y; y < tile.y + tile.height; ++y)
+			{
+				stream.write(reinterpret_cast<const char*>(colors.data() + y * width + tile.x), tile.width * sizeof(Color));
+			}
+		}
+
+		if (not stream) throw std::runtime_error("Error in when outputting part: " + filename);
+	}
+
+	if (std::rename(temporary.c_str(), filename.c_str()) != 0) throw std::runtime_error("Cannot rename " + temporary);
+}
+
+/**
+ * Waits for the parts of a frame written by the other nodes and copies their tiles into the colors of the frame.
+ * The parts are removed once merged. Fails unless every tile was rendered by exactly one node.
+ * @param indices The tiles rendered by this node.
+ */
+void merge_parts(const Options& options, uint32_t frame, uint64_t stamp, const std::vector<Region>& tiles, const std::vector<size_t>& indices,
+                 std::vector<Color>& colors, uint32_t width)
+{
+	std::vector<bool> merged(tiles.size(), false);
+	for (size_t index : indices) merged[index] = true;
+
+	auto start = std::chrono::steady_clock::now();
+	TraceSpan span("wait");
+
+	for (uint32_t node = 1; node < options.nodes; ++node)
+	{
+		std::string filename = part_filename(options, frame, node);
+
+		{
+			std::ifstream stream = open_node_file(filename, stamp, start);
+			uint64_t index;
+
+			while (stream.read(reinterpret_cast<char*>(&index), sizeof(index)))
+			{
+				if (index >= tiles.size() || merged[index]) throw std::runtime_error("Error in when reading part: " + filename);
+				const Region& tile = tiles[index];
+
+				for (uint32_t y = tile.y; y < tile.y + tile.height; ++y)
+				{
+					auto destination = reinterpret_cast<char*>(colors.data() + y * width + tile.x);
+					if (not stream.read(destination, tile.width * sizeof(Color))) throw std::runtime_error("Error in when reading part: " + filename);
+				}
+
+				merged[index] = true;
+			}
+		}
+
+		std::remove(filename.c_str());
+	}
+
+	if (std::find(merged.begin(), merged.end(), false) != merged.end()) throw std::runtime_error("Missing tiles in frame " + std::to_string(frame));
+}
+
+/**
+ * A rendered frame on its way to the encoder, with the tiles this node rendered when split across nodes.
+ */
+struct RenderedFrame
+{
+	uint32_t frame;
+	Film film;
+	uint64_t stamp = 0;
+	std::vector<size_t> indices;
+};
+
+/**
+ * Renders a range of frames as a pipeline of three stages running at the same time:
+ * building the scene of the next frame, rendering the current frame, and encoding the previous frame.
+ * The queues between the stages hold at most one frame each, which bounds the frames in flight.
+ * When split across nodes, every node renders the tiles of an equal share of the predicted cost, predicted
+ * from the rays all nodes traced in the previous frame or else from a deterministic low sample pre-pass.
+ * The other nodes write their tiles as parts, which the first node merges into the output of the frame.
+ */
+void render_sequence(const Options& options)
+{
+	auto [first, last] = *options.frames;
+	Region window = options.crop.value_or(Region{ 0, 0, options.width, options.height });
+	std::vector<Region> tiles = make_tiles(options, window);
+
+	BoundedQueue<std::pair<uint32_t, Scene>> scenes(1);
+	BoundedQueue<RenderedFrame> films(1);
+	std::exception_ptr build_error;
+	std::exception_ptr encode_error;
+
+	std::thread builder([&]()
+	{
+		try
+		{
+			for (uint32_t frame = first; frame <= last; ++frame)
+			{
+				Scene scene;
+
+				{
+					STATISTIC_STAGE("build");
+					TraceSpan span("build");
+					scene = build_scene(options, frame);
+				}
+
+				if (not wait_push(scenes, { frame, std::move(scene) })) break;
+			}
+		}
+		catch (...) { build_error = std::current_exception(); }
+
+		scenes.close();
+	});
+
+	std::thread encoder([&]()
+	{
+		try
+		{
+			while (auto next = wait_pop(films))
+			{
+				Options frame_options = options;
+				frame_options.output = frame_filename(options.output, next->frame);
+				frame_options.float_output = frame_filename(options.float_output, next->frame);
+				STATISTIC_STAGE("output");
+				TraceSpan span("encode");
+
+				if (options.nodes == 1)
+				{
+					write_output(next->film, frame_options, window);
+					continue;
+				}
+
+				std::vector<Color> colors = next->film.resolve();
+
+				if (options.node == 0)
+				{
+					merge_parts(options, next->frame, next->stamp, tiles, next->indices, colors, options.width);
+					write_colors(std::move(colors), options.width, options.height, frame_options, window);
+				}
+				else write_part(part_filename(options, next->frame, options.node), next->stamp, tiles, next->indices, colors, options.width);
+			}
+		}
+		catch (...)
+		{
+			encode_error = std::current_exception();
+			scenes.close(); //Stops the other stages early
+		}
+
+		films.close();
+	});
+
+	std::exception_ptr render_error;
+
+	try
+	{
+		uint64_t previous_stamp = 0;
+
+		while (auto next = wait_pop(scenes))
+		{
+			auto& [frame, scene] = *next;
+			Film film(options.width, options.height);
+			STATISTIC_STAGE("render");
+
+			if (options.nodes == 1)
+			{
+				render_tiles(scene, film, options, tiles, false);
+				if (not wait_push(films, { frame, std::move(film) })) break;
+				continue;
+			}
+
+			uint64_t stamp = frame_stamp(options, scene, frame);
+			bool measured = frame != first && not options.balance_costs.empty();
+			std::vector<double> predicted = measured ? read_tile_costs(options, frame - 1, previous_stamp, tiles.size()) : estimate_tile_costs(scene, options, tiles);
+			std::vector<size_t> indices = assign_tiles(predicted, options.nodes, options.node);
+
+			std::vector<Region> node_tiles;
+			double share = 0.0;
+
+			for (size_t index : indices)
+			{
+				node_tiles.push_back(tiles[index]);
+				share += predicted[index];
+			}
+
+			std::vector<uint64_t> rays;
+			bool measuring = not options.balance_costs.empty();
+			auto start = std::chrono::steady_clock::now();
+			render_tiles(scene, film, options, node_tiles, false, nullptr, nullptr, measuring ? &rays : nullptr);
+			double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+			if (measuring)
+			{
+				//Like the estimate, the cost of a tile is the number of rays it traced, which unlike its time compares across hosts
+				std::vector<double> tile_costs(tiles.size());
+				for (size_t i = 0; i < indices.size(); ++i) tile_costs[indices[i]] = static_cast<double>(rays[i]);
+				write_tile_costs(tile_costs_filename(options, frame, options.node), stamp, indices, tile_costs);
+			}
+
+			double total = std::accumulate(predicted.begin(), predicted.end(), 0.0);
+			std::cout << "Frame " << frame << ": " << indices.size() << " of " << tiles.size() << " tiles, "
+			          << share / total * 100.0 << " % of the " << (measured ? "measured" : "estimated") << " cost, "
+			          << seconds << " s" << std::endl;
+
+			previous_stamp = stamp;
+			if (not wait_push(films, { frame, std::move(film), stamp, std::move(indices) })) break;
+		}
+	}
+	catch (...) { render_error = std::current_exception(); }
+
+	scenes.close();
+	films.close();
+	builder.join();
+	encoder.join();
+
+	if (render_error) std::rethrow_exception(render_error);
+	if (build_error) std::rethrow_exception(build_error);
+	if (encode_error) std::rethrow_exception(encode_error);
+}
+
+/**
+ * Renders one sample per pixel at a time and compares the image against a reference image
+ * whenever the render time crosses a checkpoint, writing the error over time as a CSV curve.
+ * The time spent comparing is not counted as render time.
+ */
+void render_convergence(const Scene& scene, const Options& options)
+{
+	uint32_t width;
+	uint32_t height;
+	std::vector<Color> reference = read_float_image(options.converge_reference, width, height);
+	if (width != options.width || height != options.height) throw std::runtime_error("Reference image size does not match.");
+
+	std::ofstream curve(options.curve);
+	curve << "seconds,samples,mse,relative_mse,ssim\n";
+
+	using Clock = std::chrono::steady_clock;
+	Film film(width, height);
+	double elapsed = 0.0;
+	uint32_t samples = 0;
+
+	for (double checkpoint : options.checkpoints)
+	{
+		while (elapsed < checkpoint)
+		{
+			auto start = Clock::now();
+
+			STATISTIC_STAGE("render");
+
+			parallel_for(0, height, [&](uint32_t y)
+			{
+				for (uint32_t x = 0; x < width; ++x) render_pixel(scene, film, x, y, 1);
+			});
+
+			elapsed += std::chrono::duration<double>(Clock::now() - start).count();
+			++samples;
+		}
+
+		std::vector<Color> colors = film.resolve();
+		ImageError error = compare_images(width, height, colors.data(), reference.data());
+
+		curve << elapsed << ',' << samples << ',' << error.mse << ',' << error.relative_mse << ',' << error.ssim << '\n';
+		std::cout << elapsed << " s, " << samples << " spp: MSE " << error.mse << ", relMSE "
+		          << error.relative_mse << ", SSIM " << error.ssim << std::endl;
+	}
+
+	if (not curve) throw std::runtime_error("Error in when outputting convergence curve.");
+	write_image(options.output, width, height, film.resolve().data());
+}
+
+/**
+ * Outputs the cycles spent on every pixel as a false color image (filename.png) and as raw values (filename.pfm).
+ */
+void write_costs(const std::string& filename, uint32_t width, uint32_t height, const std::vector<float>& costs)
+{
+	std::vector<Color> raw(costs.size());
+	for (size_t i = 0; i < costs.size(); ++i) raw[i] = Color(costs[i]);
+
+	write_heatmap(filename + ".png", width, height, costs.data());
+	write_float_image(filename + ".pfm", width, height, raw.data());
+}
+
+/**
+ * Outputs the invalid samples collected while diagnosing: a summary grouped by function and material,
+ * a list of every sample (name.csv, in image coordinates) and a heatmap of their count per pixel (name.png and name.pfm).
+ */
+void write_invalid_report(const std::string& filename, uint32_t width, uint32_t height)
+{
+	std::lock_guard lock(invalid_samples.mutex);
+	const std::vector<InvalidSample>& samples = invalid_samples.samples;
+
+	std::ofstream list(filename + ".csv");
+	list << "x,y,depth,material,function\n";
+	std::vector<float> counts(width * height);
+
+	struct Group
+	{
+		uint64_t count = 0;
+		uint64_t depths = 0;
+	};
+
+	std::map<std::pair<std::string, uint32_t>, Group> groups;
+
+	for (const InvalidSample& sample : samples)
+	{
+		list << sample.x << ',' << height - sample.y - 1 << ',' << sample.depth << ',';
+		if (sample.material == NoMaterial) list << '-';
+		else list << sample.material;
+		list << ',' << sample.function << '\n';
+
+		counts[sample.y * width + sample.x] += 1.0f;
+		Group& group = groups[{ sample.function, sample.material }];
+		group.count += 1;
+		group.depths += sample.depth;
+	}
+
+	if (not list) throw std::runtime_error("Error in when outputting invalid samples.");
+	write_costs(filename, width, height, counts);
+
+	uint64_t total = invalid_samples.total;
+	double wasted = total == 0 ? 0.0 : static_cast<double>(samples.size()) / static_cast<double>(total);
+	std::cout << "Invalid samples: " << samples.size() << " of " << total << " (" << wasted * 100.0 << " %)" << std::endl;
+
+	for (const auto& [key, group] : groups)
+	{
+		std::cout << "  " << key.first << ", material ";
+		if (key.second == NoMaterial) std::cout << '-';
+		else std::cout << key.second;
+		std::cout << ": " << group.count << " samples, mean depth " << static_cast<double>(group.depths) / group.count << std::endl;
+	}
+}
+
+/**
+ * Renders the preview passes followed by the full resolution tiles of a single image.
+ */
+void render_image(const Scene& scene, const Options& options)
+{
+	Film film(options.width, options.height);
+	bool recording = not options.records.empty();
+	Region window = options.crop.value_or(Region{ 0, 0, options.width, options.height });
+
+	//Coarse to fine preview passes, each one immediately written out upsampled.
+	//These are skipped when recording because their paths are not part of any tile record.
+	uint32_t coarser = 0;
+
+	for (uint32_t stride : PreviewStrides)
+	{
+		if (recording) break;
+
+		{
+			STATISTIC_STAGE("render");
+			render_preview(scene, film, window, stride, coarser, not options.invalid_report.empty());
+		}
+
+		STATISTIC_STAGE("output");
+		write_output(film, options, window, stride);
+		coarser = stride;
+	}
+
+	//The full resolution pass only renders the samples not already taken by the previews
+	TileRecords records;
+	std::vector<float> costs;
+	std::vector<Region> tiles = make_tiles(options, window);
+
+	{
+		STATISTIC_STAGE("render");
+		render_tiles(scene, film, options, tiles, not recording, recording ? &records : nullptr, options.heatmap.empty() ? nullptr : &costs);
+	}
+
+	STATISTIC_STAGE("output");
+	TraceSpan span("output");
+	write_output(film, options, window);
+	if (recording) write_records(options.records, records);
+	if (not options.heatmap.empty()) write_costs(options.heatmap, film.get_width(), film.get_height(), costs);
+	if (not options.invalid_report.empty()) write_invalid_report(options.invalid_report, film.get_width(), film.get_height());
+}
+
+/**
+ * Renders a single image from a scene in shared memory with the wavefront mode, so several processes share one copy of it.
+ * Only the camera and sampling options apply, the scene options were used when the scene was shared.
+ */
+void render_shared(const Options& options)
+{
+	SharedScene scene(options.shared_scene);
+	Film film(options.width, options.height);
+	Region window = options.crop.value_or(Region{ 0, 0, options.width, options.height });
+	std::vector<Region> tiles = make_tiles(options, window);
+
+	{
+		STATISTIC_STAGE("render");
+		TraceSpan span("render");
+
+		parallel_for(0, tiles.size(), [&](uint32_t index)
+		{
+			TraceSpan span("tile");
+			render_tile_wavefront(scene, film, tiles[index], options.samples, false);
+		});
+	}
+
+	STATISTIC_STAGE("output");
+	write_output(film, options, window);
+}
+
+/**
+ * Renders a single image from a chunk file with the wavefront mode. The window is rendered as few large tiles as the
+ * OutOfCorePaths paths in flight allow, bands of whole rows unless it is wider, so that every chunk is intersected by
+ * as many rays as possible each time it is paged in. The threads share the waves of each band in turn.
+ * The chunks hold the spheres and boxes as they were written, only the planes of the room are made here with their edits.
+ */
+void render_out_of_core(const Options& options)
+{
+	Scene planes = make_scene(0, false);
+	apply_edits(planes, options.edits);
+	OutOfCoreScene scene(options.out_of_core, planes, options.chunk_budget, options.bvh);
+	Film film(options.width, options.height);
+	Region window = options.crop.value_or(Region{ 0, 0, options.width, options.height });
+
+	{
+		STATISTIC_STAGE("render");
+		TraceSpan span("render");
+		uint32_t band_width = std::clamp(window.width, 1U, OutOfCorePaths);
+		uint32_t band_height = std::max(OutOfCorePaths / band_width, 1U);
+
+		for (uint32_t y = 0; y < window.height; y += band_height)
+		{
+			for (uint32_t x = 0; x < window.width; x += band_width)
+			{
+				Region band{ window.x + x, window.y + y, std::min(band_width, window.width - x), std::min(band_height, window.height - y) };
+				render_tile_wavefront(scene, film, band, options.samples, false, OutOfCorePaths, true);
+			}
+		}
+	}
+
+	STATISTIC_STAGE("output");
+	write_output(film, options, window);
+
+	std::cout << scene.get_chunk_count() << " chunks, " << scene.get_page_ins() << " page ins, "
+	          << scene.get_peak_resident_bytes() / (1 << 20) << " MB peak resident" << std::endl;
+}
+
+/**
+ * Measures the time taken to render all tiles of a scene without previews.
+ */
+double time_render(const Scene& scene, const Options& options, uint32_t samples)
+{
+	Options render_options = options;
+	render_options.samples = samples;
+	render_options.priorities.clear();
+
+	Film film(options.width, options.height);
+	std::vector<Region> tiles = split_tiles({ 0, 0, options.width, options.height }, options.tile_size);
+
+	auto start = std::chrono::steady_clock::now();
+	render_tiles(scene, film, render_options, tiles, false);
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+/**
+ * Measures the time parallel_for takes to distribute a number of empty work items.
+ */
+double time_scheduler(uint32_t count)
+{
+	std::atomic<uint32_t> sink = 0;
+	auto start = std::chrono::steady_clock::now();
+	parallel_for(0, count, [&](uint32_t index) { sink.fetch_add(index, std::memory_order_relaxed); });
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+/**
+ * Measures the memory bandwidth (in bytes per second) of all threads reading a buffer much larger than the caches.
+ */
+double measure_bandwidth()
+{
+	constexpr uint32_t Chunks = 256;
+	constexpr size_t ChunkSize = (1 << 20) / sizeof(float); //One megabyte
+	static std::vector<float> buffer(Chunks * ChunkSize, 1.0f);
+
+	std::vector<float> sums(Chunks);
+	auto start = std::chrono::steady_clock::now();
+
+	parallel_for(0, Chunks, [&](uint32_t chunk)
+	{
+		auto begin = buffer.begin() + chunk * ChunkSize;
+		sums[chunk] = std::accumulate(begin, begin + ChunkSize, 0.0f);
+	});
+
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	if (std::accumulate(sums.begin(), sums.end(), 0.0f) != static_cast<float>(buffer.size())) throw std::runtime_error("Bandwidth check failed.");
+	return static_cast<double>(buffer.size() * sizeof(float)) / seconds;
+}
+
+/**
+ * Renders every benchmark scene with 1, 2, 4, ... threads up to the configured thread count.
+ * Strong scaling renders the same image, weak scaling multiplies the samples by the thread count so
+ * every thread has the same amount of work. Alongside, the time parallel_for takes to distribute the
+ * same number of empty tiles isolates the scheduler overhead, and a streaming read of a large buffer
+ * shows whether the memory bandwidth stops scaling before the render does.
+ */
+void measure_scaling(const Options& options)
+{
+	uint32_t max_threads = get_thread_count();
+	uint32_t samples = options.scaling_samples;
+	uint32_t tile_count = static_cast<uint32_t>(split_tiles({ 0, 0, options.width, options.height }, options.tile_size).size());
+
+	std::vector<uint32_t> thread_counts;
+	for (uint32_t threads = 1; threads < max_threads; threads *= 2) thread_counts.push_back(threads);
+	thread_counts.push_back(max_threads);
+
+	std::vector<std::pair<std::string, Scene>> scenes;
+	scenes.emplace_back("cornell", make_scene());
+
+	for (uint32_t count : { 100, 1000, 10000 })
+	{
+		ProceduralSettings settings = make_procedural_settings(ProceduralKind::Spheres, count, 0);
+		Scene scene = make_scene(0, false);
+		insert_procedural(scene, settings);
+		scenes.emplace_back("spheres_" + std::to_string(count), std::move(scene));
+	}
+
+	for (auto& [name, scene] : scenes) scene.build_bvh(options.bvh);
+
+	std::ofstream output(options.scaling_output);
+	output << "scene,threads,strong_seconds,strong_efficiency,weak_seconds,weak_efficiency,scheduler_seconds,bandwidth_gbps\n";
+
+	for (auto& [name, scene] : scenes)
+	{
+		double strong_single = 0.0;
+		double weak_single = 0.0;
+
+		for (uint32_t threads : thread_counts)
+		{
+			set_thread_count(threads);
+
+			double strong = time_render(scene, options, samples);
+			double weak = time_render(scene, options, samples * threads);
+			double scheduler = time_scheduler(tile_count);
+			double bandwidth = measure_bandwidth() / 1E9;
+
+			if (threads == 1)
+			{
+				strong_single = strong;
+				weak_single = weak;
+			}
+
+			double strong_efficiency = strong_single / (strong * threads);
+			double weak_efficiency = weak_single / weak;
+
+			output << name << ',' << threads << ',' << strong << ',' << strong_efficiency << ',' << weak << ','
+			       << weak_efficiency << ',' << scheduler << ',' << bandwidth << '\n';
+			std::cout << name << ", " << threads << " threads: strong " << strong << " s (" << strong_efficiency * 100.0
+			          << " %), weak " << weak << " s (" << weak_efficiency * 100.0 << " %), scheduler " << scheduler * 1E3
+			          << " ms, bandwidth " << bandwidth << " GB/s" << std::endl;
+		}
+	}
+
+	set_thread_count(options.threads);
+	if (not output) throw std::runtime_error("Error in when outputting scaling results.");
+}
+
+/**
+ * Checks that the steady state of rendering makes no heap allocations. After renders that fill the pools of arenas,
+ * the tiles are rendered at one and at two samples per pixel, and twice as many tiles at one sample per pixel.
+ * All three start the same workers, whose own allocations are the only ones allowed, so the counts must be equal:
+ * any difference comes from the work done for every sample or every tile. With --records, the copies of the
+ * records of every tile into their output are the only other allocations allowed, and are not counted.
+ */
+void check_allocations(const Options& options)
+{
+#ifndef ENABLE_STATISTICS
+	throw std::runtime_error("Heap allocations are only counted in the statistics build.");
+#endif
+
+	Scene scene = build_scene(options);
+	Options render_options = options;
+	render_options.priorities.clear();
+
+	//The tiles are repeated until every worker has some, so that doubling them does not start more workers
+	Film film(options.width, options.height);
+	std::vector<Region> window_tiles = split_tiles({ 0, 0, options.width, options.height }, options.tile_size);
+	std::vector<Region> tiles;
+	while (tiles.size() < static_cast<size_t>(get_thread_count()) * get_grain_size()) tiles.insert(tiles.end(), window_tiles.begin(), window_tiles.end());
+
+	std::vector<Region> doubled = tiles;
+	doubled.insert(doubled.end(), tiles.begin(), tiles.end());
+
+	auto render = [&](const std::vector<Region>& rendered, uint32_t samples)
+	{
+		render_options.samples = samples;
+		TileRecords records;
+		TileRecords* records_pointer = options.records.empty() ? nullptr : &records;
+
+		uint64_t start = get_heap_allocations();
+		render_tiles(scene, film, render_options, rendered, false, records_pointer);
+		uint64_t allocations = get_heap_allocations() - start;
+		if (records_pointer == nullptr) return allocations;
+
+		//One allocation for each of the two arrays of the records, and one for the primitives of every tile that has any
+		allocations -= 2;
+		for (const std::vector<PrimitiveID>& primitives : records.primitives) allocations -= not primitives.empty();
+		return allocations;
+	};
+
+	render(doubled, 2);
+	uint64_t single = render(tiles, 1);
+	uint64_t twice = render(tiles, 2);
+	uint64_t more_tiles = render(doubled, 1);
+
+	std::cout << "Heap allocations: " << single << " for " << tiles.size() << " tiles at 1 sample per pixel, " << twice << " at 2 samples per pixel, "
+	          << more_tiles << " for " << doubled.size() << " tiles" << std::endl;
+
+	if (twice != single) throw std::runtime_error("Rendering allocates for every sample.");
+	if (more_tiles != single) throw std::runtime_error("Rendering allocates for every tile.");
+}
+
+/**
+ * The scheduling parameters chosen by the auto-tuner.
+ */
+struct Schedule
+{
+	uint32_t tile_size = TileSize;
+	uint32_t grain = 1;
+	uint32_t threads = 1;
+};
+
+/**
+ * Returns the blocks rendered by the calibration, one at the center of every quarter of the window.
+ */
+std::vector<Region> make_calibration_blocks(const Region& window)
+{
+	uint32_t width = std::min(CalibrationBlockSize, window.width);
+	uint32_t height = std::min(CalibrationBlockSize, window.height);
+	std::vector<Region> blocks;
+
+	for (uint32_t j = 0; j < 2; ++j)
+	{
+		for (uint32_t i = 0; i < 2; ++i)
+		{
+			uint32_t x = window.width * (i * 2 + 1) / 4;
+			uint32_t y = window.height * (j * 2 + 1) / 4;
+			x = std::min(x - std::min(x, width / 2), window.width - width);
+			y = std::min(y - std::min(y, height / 2), window.height - height);
+			blocks.push_back({ window.x + x, window.y + y, width, height });
+		}
+	}
+
+	return blocks;
+}
+
+/**
+ * Measures the time taken to render the calibration blocks with a schedule, the fastest of two runs.
+ */
+double time_schedule(const Scene& scene, const Options& options, const std::vector<Region>& blocks, const Schedule& schedule)
+{
+	Options render_options = options;
+	render_options.samples = CalibrationSamples;
+	render_options.priorities.clear();
+
+	std::vector<Region> tiles;
+
+	for (const Region& block : blocks)
+	{
+		std::vector<Region> block_tiles = split_tiles(block, schedule.tile_size);
+		tiles.insert(tiles.end(), block_tiles.begin(), block_tiles.end());
+	}
+
+	set_thread_count(schedule.threads);
+	set_grain_size(schedule.grain);
+	double best = Infinity;
+
+	for (uint32_t run = 0; run < 2; ++run)
+	{
+		Film film(options.width, options.height);
+		auto start = std::chrono::steady_clock::now();
+		render_tiles(scene, film, render_options, tiles, false);
+		best = std::min(best, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+	}
+
+	return best;
+}
+
+/**
+ * Returns the name of this host and its number of hardware threads, which identify it in the tuning cache.
+ */
+std::string get_host_name()
+{
+	char name[256] = {};
+	if (gethostname(name, sizeof(name) - 1) != 0) std::strcpy(name, "unknown");
+	return std::string(name) + '/' + std::to_string(std::thread::hardware_concurrency());
+}
+
+/**
+ * Chooses the thread count, then the tile size, then the grain that render the calibration blocks the fastest.
+ * Each parameter is tuned in turn with the others fixed, so the calibration renders grow with the sum of the
+ * candidate counts rather than their product.
+ */
+Schedule calibrate_schedule(const Scene& scene, const Options& options)
+{
+	Region window = options.crop.value_or(Region{ 0, 0, options.width, options.height });
+	std::vector<Region> blocks = make_calibration_blocks(window);
+	uint32_t max_threads = get_thread_count();
+
+	Schedule best;
+	best.threads = max_threads;
+	double best_seconds = time_schedule(scene, options, blocks, best);
+
+	auto consider = [&](Schedule schedule)
+	{
+		double seconds = time_schedule(scene, options, blocks, schedule);
+		if (seconds >= best_seconds) return;
+		best = schedule;
+		best_seconds = seconds;
+	};
+
+	for (uint32_t threads = 1; threads < max_threads; threads *= 2) consider({ best.tile_size, best.grain, threads });
+
+	Schedule fixed = best;
+	for (uint32_t tile_size : CalibrationTileSizes) if (tile_size != fixed.tile_size) consider({ tile_size, fixed.grain, fixed.threads });
+
+	fixed = best;
+	for (uint32_t grain : CalibrationGrains) if (grain != fixed.grain) consider({ fixed.tile_size, grain, fixed.threads });
+
+	return best;
+}
+
+/**
+ * Sets the tile size, grain and thread count of the options to the ones that render a scene the fastest on this host.
+ * The choice is read from the tuning cache if this host already calibrated the same scene and image size,
+ * otherwise it is calibrated and appended to the cache.
+ */
+void tune_schedule(const Scene& scene, Options& options)
+{
+	std::stringstream key;
+	key << get_host_name() << ' ' << std::hex << scene.get_hash() << std::dec << ' ' << options.width << ' ' << options.height;
+
+	std::optional<Schedule> schedule;
+	std::ifstream input(options.tune_cache);
+	std::string line;
+
+	while (not schedule && std::getline(input, line))
+	{
+		std::string host, hash;
+		uint32_t width, height;
+		Schedule cached;
+
+		std::stringstream fields(line);
+		if (not (fields >> host >> hash >> width >> height >> cached.tile_size >> cached.grain >> cached.threads)) continue;
+
+		std::stringstream cached_key;
+		cached_key << host << ' ' << hash << ' ' << width << ' ' << height;
+		if (cached_key.str() == key.str() && cached.tile_size != 0 && cached.threads != 0) schedule = cached;
+	}
+
+	if (not schedule)
+	{
+		schedule = calibrate_schedule(scene, options);
+
+		std::ofstream output(options.tune_cache, std::ios::app);
+		output << key.str() << ' ' << schedule->tile_size << ' ' << schedule->grain << ' ' << schedule->threads << '\n';
+		if (not output) throw std::runtime_error("Error in when outputting tuning cache.");
+	}
+
+	options.tile_size = schedule->tile_size;
+	options.grain = schedule->grain;
+	options.threads = schedule->threads;
+	set_thread_count(options.threads);
+	set_grain_size(options.grain);
+
+	std::cout << "Schedule: tile size " << options.tile_size << ", grain " << options.grain << ", " << options.threads << " threads" << std::endl;
+}
+
+/**
+ * Parses the command line arguments.
+ * Regions are given in image coordinates (origin at the top left) and converted to film coordinates.
+ */
+Options parse_options(int argc, char** argv)
+{
+	Options options;
+	std::vector<std::string> arguments(argv + 1, argv + argc);
+	size_t current = 0;
+
+	auto next = [&]()
+	{
+		if (current == arguments.size()) throw std::runtime_error("Missing value for " + arguments.back());
+		return arguments[current++];
+	};
+
+	auto next_number = [&]() { return static_cast<uint32_t>(std::stoul(next())); };
+
+	auto next_region = [&]()
+	{
+		Region region;
+		region.x = next_number();
+		region.y = next_number();
+		region.width = next_number();
+		region.height = next_number();
+		return region;
+	};
+
+	auto next_primitive = [&]()
+	{
+		std::string kind = next();
+		uint32_t index = next_number();
+		if (kind == "sphere") return make_primitive_id(PrimitiveKind::Sphere, index);
+		if (kind == "plane") return make_primitive_id(PrimitiveKind::Plane, index);
+		if (kind == "box") return make_primitive_id(PrimitiveKind::Box, index);
+		throw std::runtime_error("Unknown primitive kind: " + kind);
+	};
+
+	while (current < arguments.size())
+	{
+		std::string name = next();
+
+		if (name == "--size")
+		{
+			options.width = next_number();
+			options.height = next_number();
+		}
+		else if (name == "--samples") options.samples = next_number();
+		else if (name == "--crop") options.crop = next_region();
+		else if (name == "--priority") options.priorities.push_back(next_region());
+		else if (name == "--output") options.output = next();
+		else if (name == "--float-output") options.float_output = next();
+		else if (name == "--composite") options.composite = next();
+		else if (name == "--records") options.records = next();
+		else if (name == "--record-depth") options.record_depth = next_number();
+		else if (name == "--edit-material")
+		{
+			Edit edit;
+			edit.primitive = next_primitive();
+			edit.material = next_number();
+			options.edits.push_back(edit);
+		}
+		else if (name == "--edit-move")
+		{
+			Edit edit;
+			edit.primitive = next_primitive();
+			edit.offset.x = std::stof(next());
+			edit.offset.y = std::stof(next());
+			edit.offset.z = std::stof(next());
+			options.edits.push_back(edit);
+		}
+		else if (name == "--frames")
+		{
+			uint32_t first = next_number();
+			uint32_t last = next_number();
+			if (last < first) throw std::runtime_error("Last frame is before the first frame.");
+			options.frames = std::make_pair(first, last);
+		}
+		else if (name == "--converge") options.converge_reference = next();
+		else if (name == "--curve") options.curve = next();
+		else if (name == "--checkpoints")
+		{
+			std::stringstream list(next());
+			std::string checkpoint;
+			options.checkpoints.clear();
+			while (std::getline(list, checkpoint, ',')) options.checkpoints.push_back(std::stod(checkpoint));
+			if (not std::is_sorted(options.checkpoints.begin(), options.checkpoints.end())) throw std::runtime_error("Checkpoints are not sorted.");
+		}
+		else if (name == "--compare")
+		{
+			options.compare.push_back(next());
+			options.compare.push_back(next());
+		}
+		else if (name == "--heatmap") options.heatmap = next();
+		else if (name == "--invalid") options.invalid_report = next();
+		else if (name == "--trace") options.trace = next();
+		else if (name == "--perf") options.perf = true;
+		else if (name == "--threads") options.threads = next_number();
+		else if (name == "--tile-size") options.tile_size = next_number();
+		else if (name == "--grain") options.grain = next_number();
+		else if (name == "--tune") options.tune = true;
+		else if (name == "--tune-cache") options.tune_cache = next();
+		else if (name == "--scene")
+		{
+			std::string kind = next();
+			uint32_t count = next_number();
+			uint32_t seed = options.procedural ? options.procedural->seed : 0;
+
+			if (kind == "spheres") options.procedural = make_procedural_settings(ProceduralKind::Spheres, count, seed);
+			else if (kind == "boxes") options.procedural = make_procedural_settings(ProceduralKind::Boxes, count, seed);
+			else if (kind == "grid") options.procedural = make_procedural_settings(ProceduralKind::Grid, count, seed);
+			else if (kind == "stack") options.procedural = make_procedural_settings(ProceduralKind::Stack, count, seed);
+			else if (kind == "emitters") options.procedural = make_procedural_settings(ProceduralKind::Emitters, count, seed);
+			else if (kind == "particles") options.procedural = make_procedural_settings(ProceduralKind::Particles, count, seed);
+			else throw std::runtime_error("Unknown scene kind: " + kind);
+		}
+		else if (name == "--node")
+		{
+			options.node = next_number();
+			options.nodes = next_number();
+			if (options.node >= options.nodes) throw std::runtime_error("Node index outside of the nodes.");
+		}
+		else if (name == "--balance-costs") options.balance_costs = next();
+		else if (name == "--run") options.run = next();
+		else if (name == "--bvh")
+		{
+			std::string layout = next();
+			if (layout == "none") options.bvh.layout = BVHLayout::None;
+			else if (layout == "binary") options.bvh.layout = BVHLayout::Binary;
+			else if (layout == "compressed") options.bvh.layout = BVHLayout::Compressed;
+			else throw std::runtime_error("Unknown BVH layout: " + layout);
+		}
+		else if (name == "--spatial-splits") options.bvh.split_budget = std::stof(next());
+		else if (name == "--treelets") options.bvh.treelets = true;
+		else if (name == "--lazy-bvh") options.bvh.lazy_size = next_number();
+		else if (name == "--wavefront") options.wavefront = true;
+		else if (name == "--write-chunks")
+		{
+			options.write_chunks = next();
+			options.chunk_primitives = next_number();
+		}
+		else if (name == "--out-of-core")
+		{
+			options.out_of_core = next();
+			options.chunk_budget = static_cast<size_t>(next_number()) << 20;
+		}
+		else if (name == "--particles") options.particles = next();
+		else if (name == "--write-particles") options.write_particles = next();
+		else if (name == "--share-scene") options.share_scene = next();
+		else if (name == "--unshare-scene") options.unshare_scene = next();
+		else if (name == "--shared-scene") options.shared_scene = next();
+		else if (name == "--huge-pages")
+		{
+			std::string mode = next();
+			if (mode == "off") options.huge_pages = HugePages::Off;
+			else if (mode == "transparent") options.huge_pages = HugePages::Transparent;
+			else if (mode == "explicit") options.huge_pages = HugePages::Explicit;
+			else throw std::runtime_error("Unknown huge page mode: " + mode);
+		}
+		else if (name == "--seed")
+		{
+			if (not options.procedural) throw std::runtime_error("--seed must follow --scene.");
+			options.procedural->seed = next_number();
+		}
+		else if (name == "--scaling") options.scaling_samples = next_number();
+		else if (name == "--scaling-output") options.scaling_output = next();
+		else if (name == "--check-allocations") options.check_allocations = true;
+		else if (name == "--update")
+		{
+			options.update_image = next();
+			options.update_records = next();
+		}
+		else throw std::runtime_error("Unknown argument: " + name);
+	}
+
+	if (options.width == 0 || options.height == 0 || options.samples == 0) throw std::runtime_error("Empty render.");
+	if (options.tile_size == 0 || options.grain == 0) throw std::runtime_error("Empty tiles.");
+	if (not options.invalid_report.empty() && (options.frames || not options.converge_reference.empty() || not options.update_image.empty()))
+	{
+		throw std::runtime_error("Invalid samples can only be diagnosed when rendering a single image.");
+	}
+
+	if (options.wavefront && not (options.records.empty() && options.update_image.empty() && options.invalid_report.empty()))
+	{
+		throw std::runtime_error("The wavefront mode cannot record paths or invalid samples.");
+	}
+
+	bool single_image = not options.frames && options.records.empty() && options.update_image.empty() && options.converge_reference.empty();
+
+	if (not options.out_of_core.empty() && not (single_image && options.heatmap.empty() && options.invalid_report.empty()))
+	{
+		throw std::runtime_error("The out-of-core mode only renders single images without records, costs or invalid samples.");
+	}
+
+	auto edits_plane = [](const Edit& edit) { return get_primitive_kind(edit.primitive) == PrimitiveKind::Plane; };
+
+	if (not options.out_of_core.empty() && not std::all_of(options.edits.begin(), options.edits.end(), edits_plane))
+	{
+		throw std::runtime_error("The out-of-core mode can only edit planes, the other primitives are edited when writing the chunks.");
+	}
+
+	if (not options.shared_scene.empty() && not (single_image && options.heatmap.empty() && options.invalid_report.empty()))
+	{
+		throw std::runtime_error("Shared scenes only render single images without records, costs or invalid samples.");
+	}
+
+	if (not options.share_scene.empty() && options.bvh.lazy_size > 0) throw std::runtime_error("A lazy BVH cannot be shared.");
+
+	if (options.nodes > 1 && not options.frames) throw std::runtime_error("Only sequences can be split across nodes.");
+	if (not options.update_image.empty() && (options.crop || not options.composite.empty())) throw std::runtime_error("Cannot crop an update.");
+	if (options.frames && not (options.update_image.empty() && options.records.empty())) throw std::runtime_error("Cannot update a sequence.");
+
+	auto convert = [&](Region& region)
+	{
+		if (region.x + region.width > options.width || region.y + region.height > options.height)
+		{
+			throw std::runtime_error("Region outside of the image.");
+		}
+
+		region.y = options.height - region.y - region.height;
+	};
+
+	if (options.crop) convert(*options.crop);
+	for (Region& priority : options.priorities) convert(priority);
+	return options;
+}
+
+int main(int argc, char** argv)
+{
+	try
+	{
+		Options options = parse_options(argc, argv);
+		set_tracing(not options.trace.empty());
+		set_thread_count(options.threads);
+		set_grain_size(options.grain);
+		set_huge_pages(options.huge_pages);
+		if (options.perf && not enable_perf_counters()) std::cerr << "Performance counters are not available." << std::endl;
+
+		if (not options.compare.empty())
+		{
+			uint32_t width, height, reference_width, reference_height;
+			std::vector<Color> colors = read_float_image(options.compare[0], width, height);
+			std::vector<Color> reference = read_float_image(options.compare[1], reference_width, reference_height);
+			if (width != reference_width || height != reference_height) throw std::runtime_error("Image sizes do not match.");
+
+			ImageError error = compare_images(width, height, colors.data(), reference.data());
+			std::cout << "MSE " << error.mse << ", relMSE " << error.relative_mse << ", SSIM " << error.ssim << std::endl;
+			return 0;
+		}
+
+		if (options.frames)
+		{
+			if (options.tune) tune_schedule(build_scene(options, options.frames->first), options);
+			render_sequence(options);
+		}
+		else if (options.scaling_samples != 0) measure_scaling(options);
+		else if (options.check_allocations) check_allocations(options);
+		else if (not options.write_chunks.empty()) OutOfCoreScene::write(build_scene(options), options.write_chunks, options.chunk_primitives);
+		else if (not options.write_particles.empty()) build_scene(options).write_particles(options.write_particles);
+		else if (not options.out_of_core.empty()) render_out_of_core(options);
+		else if (not options.share_scene.empty())
+		{
+			Scene scene = build_scene(options);
+			SharedScene::create(scene, options.share_scene);
+			std::cout << "Shared scene: " << SharedScene(options.share_scene).get_bytes() / (1 << 20) << " MB" << std::endl;
+		}
+		else if (not options.unshare_scene.empty()) SharedScene::remove(options.unshare_scene);
+		else if (not options.shared_scene.empty()) render_shared(options);
+		else
+		{
+			Scene scene = build_scene(options);
+			if (is_perf_enabled()) std::cout << "Huge pages: " << get_huge_page_bytes() / (1 << 20) << " MB" << std::endl;
+			if (options.tune) tune_schedule(scene, options);
+
+			if (not options.converge_reference.empty()) render_convergence(scene, options);
+			else if (not options.update_image.empty()) render_update(scene, options);
+			else render_image(scene, options);
+
+			const BVH& bvh = scene.get_bvh();
+			if (bvh.get_subtree_count() > 0) std::cout << "Lazy BVH: built " << bvh.get_built_subtree_count() << " of " << bvh.get_subtree_count() << " subtrees, " << bvh.get_bytes() / (1 << 20) << " MB" << std::endl;
+		}
+
+#ifdef ENABLE_STATISTICS
+		print_statistics(std::cout, "render");
+#endif
+
+		if (not options.trace.empty()) write_trace(options.trace);
+		if (is_perf_enabled()) print_perf_counters(std::cout);
+	}
+	catch (const std::exception& exception)
+	{
+		std::cerr << exception.what() << std::endl;
+		return 1;
+	}
 
-	write_image("output.png", ImageWidth, ImageHeight, colors.data());
 	return 0;
 }
 
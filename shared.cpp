@@ -0,0 +1,346 @@
+#include "library.hpp"
+
+#include <atomic>
+#include <bit>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+constexpr char SharedMagic[8] = { 'S', 'C', 'E', 'N', 'E', 'S', '0', '2' };
+constexpr uint32_t MaxSharedDepth = 127; //The deepest node whose traversal fits in the stacks of both layouts
+
+/**
+ * The start of a shared scene segment. Every array follows at an offset from the start of the segment aligned to a cache line,
+ * and the nodes to a page so that BVH treelets line up with the pages of the segment as they do in a scene.
+ */
+struct SharedSceneHeader
+{
+	char magic[8];
+	uint32_t layout; //The BVHLayout of the nodes
+	uint32_t node_size;
+	uint64_t size;
+
+	uint64_t sphere_count;
+	uint64_t plane_count;
+	uint64_t box_count;
+	uint64_t particle_count;
+	uint64_t node_count;
+	uint64_t reference_count;
+
+	uint64_t sphere_offset;
+	uint64_t plane_offset;
+	uint64_t box_offset;
+	uint64_t particle_offset;
+	uint64_t node_offset;
+	uint64_t reference_offset;
+};
+
+static uint64_t align_offset(uint64_t offset, uint64_t alignment = CacheLineSize) { return (offset + alignment - 1) / alignment * alignment; }
+
+void SharedScene::create(const Scene& scene, const std::string& name)
+{
+	const BVH& bvh = scene.bvh;
+	if (bvh.get_subtree_count() > 0) throw std::invalid_argument("A lazy BVH cannot be shared.");
+
+	SharedSceneHeader header{};
+	std::memcpy(header.magic, SharedMagic, sizeof(SharedMagic));
+	header.layout = static_cast<uint32_t>(bvh.layout);
+	header.node_size = bvh.layout == BVHLayout::Compressed ? sizeof(CompressedNode) : sizeof(BVHNode);
+
+	header.sphere_count = scene.spheres.size();
+	header.plane_count = scene.planes.size();
+	header.box_count = scene.boxes.size();
+	header.particle_count = scene.particles.size();
+	header.node_count = bvh.layout == BVHLayout::Compressed ? bvh.compressed_nodes.size() : bvh.nodes.size();
+	header.reference_count = bvh.references.size();
+
+	header.sphere_offset = align_offset(sizeof(header));
+	header.plane_offset = align_offset(header.sphere_offset + header.sphere_count * sizeof(SphereRecord));
+	header.box_offset = align_offset(header.plane_offset + header.plane_count * sizeof(PlaneRecord));
+	header.particle_offset = align_offset(header.box_offset + header.box_count * sizeof(BoxRecord));
+	header.node_offset = align_offset(header.particle_offset + header.particle_count * sizeof(ParticleLeaf), PageSize);
+	header.reference_offset = align_offset(header.node_offset + header.node_count * header.node_size);
+	header.size = header.reference_offset + header.reference_count * sizeof(PrimitiveID);
+
+	int file = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+	if (file < 0) throw std::runtime_error("Error in when creating shared scene: " + name);
+
+	void* pointer = ftruncate(file, static_cast<off_t>(header.size)) != 0 ? MAP_FAILED : mmap(nullptr, header.size, PROT_READ | PROT_WRITE, MAP_SHARED, file, 0);
+	close(file);
+
+	if (pointer == MAP_FAILED)
+	{
+		shm_unlink(name.c_str());
+		throw std::runtime_error("Error in when creating shared scene: " + name);
+	}
+
+	//The pages are allocated as they are written here, so this is where they can become huge pages
+	if (get_huge_pages() != HugePages::Off) madvise(pointer, header.size, MADV_HUGEPAGE);
+
+	std::byte* mapping = static_cast<std::byte*>(pointer);
+
+	auto* spheres = reinterpret_cast<SphereRecord*>(mapping + header.sphere_offset);
+	auto* planes = reinterpret_cast<PlaneRecord*>(mapping + header.plane_offset);
+	auto* boxes = reinterpret_cast<BoxRecord*>(mapping + header.box_offset);
+
+	for (size_t i = 0; i < scene.spheres.size(); ++i)
+	{
+		auto& [center, radius, material] = scene.spheres[i];
+		spheres[i] = { center, radius, material };
+	}
+
+	for (size_t i = 0; i < scene.planes.size(); ++i)
+	{
+		auto& [normal, offset, material] = scene.planes[i];
+		planes[i] = { normal, offset, material };
+	}
+
+	for (size_t i = 0; i < scene.boxes.size(); ++i)
+	{
+		auto& [min, max, material] = scene.boxes[i];
+		boxes[i] = { min, max, material };
+	}
+
+	if (header.particle_count > 0) std::memcpy(mapping + header.particle_offset, scene.particles.data(), header.particle_count * sizeof(ParticleLeaf));
+
+	const void* nodes = bvh.layout == BVHLayout::Compressed ? static_cast<const void*>(bvh.compressed_nodes.data()) : bvh.nodes.data();
+	if (header.node_count > 0) std::memcpy(mapping + header.node_offset, nodes, header.node_count * header.node_size);
+	if (header.reference_count > 0) std::memcpy(mapping + header.reference_offset, bvh.references.data(), header.reference_count * sizeof(PrimitiveID));
+
+	//The header is published last, with the magic stored atomically after the rest, so a process attaching while the
+	//arrays are written finds no magic and fails instead of reading a partial scene
+	std::memcpy(mapping + sizeof(header.magic), reinterpret_cast<const std::byte*>(&header) + sizeof(header.magic), sizeof(header) - sizeof(header.magic));
+	std::atomic_ref<uint64_t>(*reinterpret_cast<uint64_t*>(mapping)).store(std::bit_cast<uint64_t>(SharedMagic), std::memory_order_release);
+
+	munmap(pointer, header.size);
+}
+
+/**
+ * Returns whether every reference is to a sphere, box or leaf of particles within the counts of the segment.
+ */
+static bool valid_references(const PrimitiveID* references, const SharedSceneHeader& header)
+{
+	for (uint64_t i = 0; i < header.reference_count; ++i)
+	{
+		uint64_t index = get_primitive_index(references[i]);
+		PrimitiveKind kind = get_primitive_kind(references[i]);
+
+		if (kind == PrimitiveKind::Sphere && index < header.sphere_count) continue;
+		if (kind == PrimitiveKind::Box && index < header.box_count) continue;
+		if (kind == PrimitiveKind::Particles && index < header.particle_count) continue;
+		return false;
+	}
+
+	return true;
+}
+
+/**
+ * Returns whether the nodes form a tree below the root whose children and leaf references lie within the segment,
+ * shallow enough for the traversal stacks. As every node is reached at most once, traversals always end.
+ * @param children Outputs the inner children of a node and returns whether its leaf references are within the segment.
+ */
+template<class Node, class Children>
+static bool valid_nodes(const Node* nodes, const SharedSceneHeader& header, const Children& children)
+{
+	if (header.node_count == 0) return true;
+
+	std::vector<bool> reached(header.node_count);
+	std::vector<std::pair<uint64_t, uint32_t>> stack = { { 0, 0 } };
+	reached[0] = true;
+
+	while (not stack.empty())
+	{
+		auto [index, depth] = stack.back();
+		stack.pop_back();
+
+		uint64_t first;
+		uint64_t count;
+		if (not children(nodes[index], first, count)) return false;
+		if (count > 0 && (depth == MaxSharedDepth || first > header.node_count || count > header.node_count - first)) return false;
+
+		for (uint64_t child = first; child < first + count; ++child)
+		{
+			if (reached[child]) return false;
+			reached[child] = true;
+			stack.emplace_back(child, depth + 1);
+		}
+	}
+
+	return true;
+}
+
+static bool valid_nodes(const BVHNode* nodes, const SharedSceneHeader& header)
+{
+	return valid_nodes(nodes, header, [&](const BVHNode& node, uint64_t& first, uint64_t& count)
+	{
+		first = node.index;
+		count = node.count > 0 ? 0 : 2;
+		return node.count == 0 || uint64_t(node.index) + node.count <= header.reference_count;
+	});
+}
+
+static bool valid_nodes(const CompressedNode* nodes, const SharedSceneHeader& header)
+{
+	return valid_nodes(nodes, header, [&](const CompressedNode& node, uint64_t& first, uint64_t& count)
+	{
+		first = node.child_base;
+		count = std::popcount(static_cast<uint32_t>(node.inner_mask & 0xF));
+
+		for (uint32_t i = 0; i < 4; ++i)
+		{
+			if ((node.inner_mask >> i & 1) != 0) continue;
+			if (uint64_t(node.reference_base) + (node.meta[i] >> 3) + (node.meta[i] & 7) > header.reference_count) return false;
+		}
+
+		return true;
+	});
+}
+
+void SharedScene::remove(const std::string& name)
+{
+	if (shm_unlink(name.c_str()) != 0) throw std::runtime_error("Error in when removing shared scene: " + name);
+}
+
+SharedScene::SharedScene(const std::string& name)
+{
+	int file = shm_open(name.c_str(), O_RDONLY, 0);
+	if (file < 0) throw std::runtime_error("Error in when reading shared scene: " + name);
+
+	struct stat status;
+	fstat(file, &status);
+	mapping_size = static_cast<size_t>(status.st_size);
+
+	void* pointer = mapping_size < sizeof(SharedSceneHeader) ? MAP_FAILED : mmap(nullptr, mapping_size, PROT_READ, MAP_SHARED, file, 0);
+	close(file);
+	if (pointer == MAP_FAILED) throw std::runtime_error("Error in when reading shared scene: " + name);
+
+	//Once the magic is seen, everything written before it is too. Without it nothing else is read, it may still be written.
+	mapping = static_cast<const std::byte*>(pointer);
+	uint64_t magic = std::atomic_ref<uint64_t>(*static_cast<uint64_t*>(pointer)).load(std::memory_order_acquire);
+	SharedSceneHeader header{};
+	if (magic == std::bit_cast<uint64_t>(SharedMagic)) std::memcpy(&header, mapping, sizeof(header));
+
+	//Every array has to fit in the segment, with the counts bounded first so the products cannot overflow
+	auto fits = [&](uint64_t offset, uint64_t count, uint64_t size)
+	{
+		return offset % CacheLineSize == 0 && offset <= mapping_size && count <= (mapping_size - offset) / size;
+	};
+
+	auto layout_value = static_cast<BVHLayout>(header.layout);
+	uint32_t node_size = layout_value == BVHLayout::Compressed ? sizeof(CompressedNode) : sizeof(BVHNode);
+
+	bool valid = std::memcmp(header.magic, SharedMagic, sizeof(SharedMagic)) == 0 && header.size == mapping_size &&
+	             header.layout <= static_cast<uint32_t>(BVHLayout::Compressed) && header.node_size == node_size &&
+	             (layout_value == BVHLayout::None) == (header.node_count == 0) &&
+	             fits(header.sphere_offset, header.sphere_count, sizeof(SphereRecord)) &&
+	             fits(header.plane_offset, header.plane_count, sizeof(PlaneRecord)) &&
+	             fits(header.box_offset, header.box_count, sizeof(BoxRecord)) &&
+	             fits(header.particle_offset, header.particle_count, sizeof(ParticleLeaf)) &&
+	             fits(header.node_offset, header.node_count, node_size) &&
+	             fits(header.reference_offset, header.reference_count, sizeof(PrimitiveID));
+
+	if (not valid)
+	{
+		munmap(pointer, mapping_size);
+		throw std::runtime_error("Invalid shared scene: " + name);
+	}
+
+	//The contents are checked as well, so a damaged or foreign segment cannot make traversals read outside of it
+	auto leaves = reinterpret_cast<const ParticleLeaf*>(mapping + header.particle_offset);
+	auto valid_leaf = [](const ParticleLeaf& leaf) { return leaf.count <= ParticleLeafSize; };
+	auto reference_pointer = reinterpret_cast<const PrimitiveID*>(mapping + header.reference_offset);
+
+	valid = std::all_of(leaves, leaves + header.particle_count, valid_leaf) && valid_references(reference_pointer, header) &&
+	        (layout_value == BVHLayout::Compressed ? valid_nodes(reinterpret_cast<const CompressedNode*>(mapping + header.node_offset), header) :
+	                                                 valid_nodes(reinterpret_cast<const BVHNode*>(mapping + header.node_offset), header));
+
+	if (not valid)
+	{
+		munmap(pointer, mapping_size);
+		throw std::runtime_error("Invalid shared scene: " + name);
+	}
+
+	layout = layout_value;
+	spheres = reinterpret_cast<const SphereRecord*>(mapping + header.sphere_offset);
+	planes = reinterpret_cast<const PlaneRecord*>(mapping + header.plane_offset);
+	boxes = reinterpret_cast<const BoxRecord*>(mapping + header.box_offset);
+	particles = reinterpret_cast<const ParticleLeaf*>(mapping + header.particle_offset);
+	nodes = mapping + header.node_offset;
+	references = reinterpret_cast<const PrimitiveID*>(mapping + header.reference_offset);
+	sphere_count = header.sphere_count;
+	plane_count = header.plane_count;
+	box_count = header.box_count;
+	particle_count = header.particle_count;
+}
+
+SharedScene::~SharedScene()
+{
+	munmap(const_cast<std::byte*>(mapping), mapping_size);
+}
+
+bool SharedScene::intersect(const Ray& ray, float& distance, Vec3& normal, uint32_t& material) const
+{
+	distance = Infinity;
+
+	for (size_t i = 0; i < plane_count; ++i)
+	{
+		float new_distance = intersect_plane(ray, planes[i].normal, planes[i].offset);
+
+		if (new_distance < distance)
+		{
+			distance = new_distance;
+			normal = planes[i].normal;
+			material = planes[i].material;
+		}
+	}
+
+	auto test = [&](PrimitiveID id)
+	{
+		STATISTIC(primitive_tests += 1);
+		uint32_t index = get_primitive_index(id);
+		Vec3 new_normal;
+		float new_distance;
+		uint32_t new_material;
+
+		if (get_primitive_kind(id) == PrimitiveKind::Sphere)
+		{
+			const SphereRecord& sphere = spheres[index];
+			new_distance = intersect_sphere(ray, sphere.center, sphere.radius, new_normal);
+			new_material = sphere.material;
+		}
+		else if (get_primitive_kind(id) == PrimitiveKind::Particles)
+		{
+			new_distance = intersect_particles(ray, particles[index], distance, new_normal);
+			new_material = particles[index].material;
+		}
+		else
+		{
+			const BoxRecord& box = boxes[index];
+			new_distance = intersect_box(ray, box.min, box.max, new_normal);
+			new_material = box.material;
+		}
+
+		if (new_distance >= distance) return;
+		distance = new_distance;
+		normal = new_normal;
+		material = new_material;
+	};
+
+	STATISTIC(primitive_tests += plane_count);
+
+	if (layout == BVHLayout::Binary) BVH::traverse_binary(static_cast<const BVHNode*>(nodes), references, ray, distance, test);
+	else if (layout == BVHLayout::Compressed) BVH::traverse_compressed(static_cast<const CompressedNode*>(nodes), references, ray, distance, test);
+	else
+	{
+		for (size_t i = 0; i < sphere_count; ++i) test(make_primitive_id(PrimitiveKind::Sphere, i));
+		for (size_t i = 0; i < box_count; ++i) test(make_primitive_id(PrimitiveKind::Box, i));
+		for (size_t i = 0; i < particle_count; ++i) test(make_primitive_id(PrimitiveKind::Particles, i));
+	}
+
+	return std::isfinite(distance);
+}